@@ -1,5 +1,5 @@
 #include <funkeymonkey/funkeymonkeymodule.h>
-#include <funkeymonkey/uinputdevice.h>
+#include <linux/uinput.h>
 
 #include <iostream>
 #include <thread>
@@ -8,11 +8,29 @@
 #include <condition_variable>
 #include <regex>
 #include <fstream>
+#include <sstream>
 #include <algorithm>
 #include <cctype>
 #include <unordered_map>
 #include <functional>
 #include <array>
+#include <bitset>
+#include <atomic>
+#include <cstdint>
+#include <csignal>
+#include <climits>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#ifdef HAVE_LIBSYSTEMD
+#include <systemd/sd-daemon.h>
+#endif
 #include <stdlib.h> 
 
 enum Role { ROLE_LEFT_NUB, ROLE_RIGHT_NUB, ROLE_KEYBOARD, ROLE_GPIO };
@@ -39,6 +57,116 @@ struct Scripts {
 	std::string FnShiftCtrl	= "";
 };
 
+// Fixed size ring of the latest input and output events. Recording is a
+// relaxed fetch_add and a slot write, so it stays on all the time; the ring
+// is written out raw by dump(), which is async-signal-safe.
+struct FlightRecorder {
+	enum Direction : uint8_t { INPUT, OUTPUT };
+	enum Device : uint8_t { DEVICE_KEYBOARD, DEVICE_GAMEPAD, DEVICE_MOUSE };
+	enum Origin : uint8_t {
+		ORIGIN_NONE, ORIGIN_KEY, ORIGIN_NUB_GAMEPAD, ORIGIN_NUB_AXIS,
+		ORIGIN_NUB_CLICK, ORIGIN_NUB_BUTTON, ORIGIN_MOUSE_THREAD, ORIGIN_PROFILE,
+		ORIGIN_TIMER, ORIGIN_MACRO
+	};
+	struct Record {
+		uint64_t time;		// CLOCK_MONOTONIC, in ns
+		uint32_t sequence;
+		uint16_t type;
+		uint16_t code;
+		int32_t value;
+		uint8_t direction;
+		uint8_t source;		// Role for inputs, Device for outputs
+		uint8_t origin;		// Origin of outputs
+		uint8_t detail;		// KeyBehavior type or nub mode of outputs
+	};
+	struct Header {
+		char magic[8];
+		uint32_t version;
+		uint32_t recordSize;
+		uint32_t capacity;
+		uint32_t count;		// Records ever written, the ring holds the last capacity
+	};
+	static constexpr uint32_t CAPACITY = 4096;
+	static_assert((CAPACITY & (CAPACITY - 1)) == 0, "CAPACITY must be a power of two");
+
+	void record(uint8_t direction, uint8_t source, uint16_t type, uint16_t code, int32_t value, uint8_t origin, uint8_t detail);
+	bool dump() const;
+
+	bool enabled = true;
+	char path[PATH_MAX] = "";
+	std::atomic<uint32_t> next{0};
+	std::array<Record, CAPACITY> records;
+};
+
+// What is producing outputs on the current thread, tagged on recorded writes
+thread_local uint8_t recorderOrigin = FlightRecorder::ORIGIN_NONE;
+thread_local uint8_t recorderDetail = 0;
+
+inline void setOrigin(uint8_t origin, uint8_t detail = 0) {
+	recorderOrigin = origin;
+	recorderDetail = detail;
+}
+
+// uinput device whose writes go through the flight recorder. The device can
+// be adopted from an fd kept in the systemd fd store by a previous instance,
+// and left alive on destruction for the next one.
+class OutputDevice {
+public:
+	using Events = std::vector<std::pair<int, std::vector<unsigned int>>>;
+	// Absolute axes range, covers nub readings and hats as sent
+	static constexpr int ABS_LIMIT = 65535;
+
+	OutputDevice(std::string const& devnode, unsigned int bustype, std::string const& name, unsigned int vendor, unsigned int product, unsigned int version, Events const& events);
+	explicit OutputDevice(int fd);
+	OutputDevice(OutputDevice&& other);
+	~OutputDevice();
+	void send(unsigned int type, unsigned int code, int value);
+	int fd() const { return _fd; }
+
+	FlightRecorder::Device id = FlightRecorder::DEVICE_KEYBOARD;
+	// Do not destroy the uinput device, it is handed over to the next instance
+	bool keep = false;
+
+private:
+	int _fd;
+};
+
+// Output event of a macro, delay is in us since the previous event
+struct MacroEvent {
+	uint32_t delay;
+	uint16_t type;
+	uint16_t code;
+	int32_t value;
+	uint8_t device;		// FlightRecorder::Device
+	uint8_t reserved[3];
+};
+static_assert(sizeof(MacroEvent) == 16, "MacroEvent is stored raw in macro files");
+
+struct Macro {
+	std::vector<MacroEvent> events;
+};
+
+// Keys down per output device
+using HeldKeys = std::array<std::bitset<KEY_CNT>, FlightRecorder::DEVICE_MOUSE + 1>;
+
+// Macros are named files in this directory only, the daemon runs as root
+static char const MACRO_DIR[] = "/var/lib/pyrainput/macros/";
+
+// Outputs captured into a macro while active. Releases of keys pressed
+// before the start and presses of keys still down at the stop belong to
+// whatever started and stopped the recording and are left out.
+struct MacroRecorder {
+	static constexpr size_t MAX_EVENTS = 4096;
+	std::atomic<bool> active{false};
+	std::string file;
+	Macro macro;
+	HeldKeys held;
+	std::chrono::steady_clock::time_point last;
+	std::mutex mutex;
+};
+
+struct Settings;
+
 static constexpr unsigned int FIRST_KEY = KEY_RESERVED;
 static constexpr unsigned int LAST_KEY = KEY_UNKNOWN;
 
@@ -52,12 +180,19 @@ public:
 	void altmap(unsigned int code, bool* flag, unsigned int regular, unsigned int alternative);
 	void complex(unsigned int code, std::function<void(int)> function);
 	void script(unsigned int code, Scripts *s);
+	void macro(unsigned int code, Macro const* m);
 	void handle(unsigned int code, int value);
+	// Settings of the profile owning this table, held keys keep using them
+	void bind(Settings const* s) { settings = s; }
+	bool pressedAs(unsigned int code) const;
+	void setPressedAs(unsigned int code, bool alternative);
+	// Keyboard key a held key was resolved to, -1 if it does not repeat
+	int repeatCode(unsigned int code, bool* navigation) const;
 
 private:
 	struct KeyBehavior {
-		KeyBehavior() : type(PASSTHROUGH), mapping(0), function() {}
-		enum Type  { PASSTHROUGH, MAPPED, ALTMAPPED, COMPLEX, GPMAPPED,GPMAP2, GPHAT, SCRIPT };
+		KeyBehavior() : type(PASSTHROUGH), mapping(0), pressed_as(false), function() {}
+		enum Type  { PASSTHROUGH, MAPPED, ALTMAPPED, COMPLEX, GPMAPPED,GPMAP2, GPHAT, SCRIPT, MACRO };
 		Type type;
 		int mapping;
 		int alternative;
@@ -65,16 +200,18 @@ private:
 		bool* flag;
 		LeftRight* lr;
 		Scripts *scripts;
+		Macro const* macro;
 		std::function<void(int)> function;
 	};
 
 	static constexpr unsigned int NUM_KEYS = LAST_KEY - FIRST_KEY + 1;
 	std::array<KeyBehavior, NUM_KEYS> behaviors;
+	Settings const* settings = nullptr;
 };
 
 struct Mouse {
 	// Any thread using device must hold mutex
-	UinputDevice device;
+	OutputDevice device;
 	
 	// May be changed from any thread at any time
 	int dx;
@@ -87,6 +224,48 @@ struct Mouse {
 	
 	// Mouse device mutex
 	std::mutex mutex;
+
+	// Nub axis sinks holding BTN_LEFT and BTN_RIGHT, uses mutex
+	std::array<unsigned int, 2> axisHolders;
+};
+
+// Eager keypad debounce, indexed by keycode. The first edge of a key goes
+// through at once; changes within the window after it are held and settled
+// by the timer thread when the window ends.
+struct Debounce {
+	static constexpr unsigned int NUM_KEYS = LAST_KEY - FIRST_KEY + 1;
+	std::array<uint32_t, NUM_KEYS> last{};		// Last accepted transition, steady clock ms
+	std::array<uint8_t, NUM_KEYS> raw{};		// Last state reported by the keypad
+	std::array<uint8_t, NUM_KEYS> state{};		// State forwarded to the behaviors
+	std::array<uint32_t, NUM_KEYS> filtered{};	// Bounces and duplicates dropped
+};
+
+// Deadlines run by the timer thread
+struct Timer {
+	// Key repeat, repeatCode is the resolved keyboard key or -1
+	int repeatKey = -1;
+	int repeatCode = -1;
+	std::chrono::steady_clock::time_point repeatAt;
+	std::chrono::microseconds repeatInterval;
+
+	// Keys held by the debounce filter are settled at debounceAt
+	bool debouncePending = false;
+	std::chrono::steady_clock::time_point debounceAt;
+
+	// Macro playbacks, free slots have no macro. Keys a macro leaves down
+	// are released when it ends.
+	struct Playback {
+		Macro const* macro = nullptr;
+		size_t next = 0;
+		std::chrono::steady_clock::time_point at;
+		HeldKeys held;
+	};
+	static constexpr unsigned int MAX_PLAYBACKS = 4;
+	std::array<Playback, MAX_PLAYBACKS> playbacks;
+
+	// Used to signal changes in above values, uses mutex
+	std::condition_variable signal;
+	std::mutex mutex;
 };
 
 
@@ -102,10 +281,10 @@ struct Settings {
 		MOUSE_LEFT, MOUSE_RIGHT
 	};
 	
-	NubAxisMode leftNubModeX = MOUSE_X;
-	NubAxisMode leftNubModeY = MOUSE_Y;
-	NubAxisMode rightNubModeX = MOUSE_BTN;
-	NubAxisMode rightNubModeY = SCROLL_Y;
+	std::vector<NubAxisMode> leftNubModeX = { MOUSE_X };
+	std::vector<NubAxisMode> leftNubModeY = { MOUSE_Y };
+	std::vector<NubAxisMode> rightNubModeX = { MOUSE_BTN };
+	std::vector<NubAxisMode> rightNubModeY = { SCROLL_Y };
 	NubClickMode leftNubClickMode = MOUSE_LEFT;
 	NubClickMode rightNubClickMode = MOUSE_RIGHT;
 	
@@ -120,10 +299,53 @@ struct Settings {
 	bool exportMouse   = true;
 	bool exportKeypad  = true;
 
+	// Daemon side key repeat, per class: regular keys and navigation keys
+	enum RepeatClass { REPEAT_KEYS, REPEAT_NAVIGATION, REPEAT_CLASSES };
+	bool keyRepeat = false;
+	std::array<int, REPEAT_CLASSES> repeatDelay = {{ 250, 250 }};	// ms
+	std::array<int, REPEAT_CLASSES> repeatRate = {{ 30, 30 }};	// per second
+
+	// Keypad debounce window in ms, 0 disables it
+	int debounceWindow = 0;
+	std::string debounceStatsFile = "/var/lib/pyrainput/debounce";
+
+	// Macro name in MACRO_DIR played by each keycode
+	std::unordered_map<unsigned int, std::string> macros;
+
+	// Online nub center calibration
+	bool nubCalibration = true;
+	int nubCalibrationWindow = 60;
+	int nubCalibrationStill = 4;
+	int nubCalibrationSettle = 1000;	// ms
+	int nubCalibrationRate = 6;
+	std::string calibrationFile = "/var/lib/pyrainput/calibration";
+
 	std::string configFile;
+	std::string profileFile = "/run/pyrainput/profile";
+	bool recorderEnable = true;
+	std::string recorderFile = "/var/lib/pyrainput/recorder.bin";
 	Scripts brightness;
 };
 
+// Tracks the resting center and noise floor of a single nub axis.
+// Values are kept in fixed point with CALIBRATION_FP fractional bits and
+// updated as exponential moving averages, so each reading costs O(1).
+struct NubCalibration {
+	static constexpr int CALIBRATION_FP = 8;
+	static constexpr int CALIBRATION_ONE = 1 << CALIBRATION_FP;
+	int center = 0;
+	int noise = 0;		// Average change between still readings
+	int last = 0;		// Previous raw reading
+	std::chrono::steady_clock::time_point movedAt;	// Last reading that was not still
+
+	// Feed a raw reading, returns the reading relative to the resting center
+	int correct(int value, Settings const& settings);
+	// Learn from the last reading again, the input core sends no repeated
+	// readings of a nub resting still. Returns it relative to the center.
+	int settle(Settings const& settings);
+	bool learn(Settings const& settings);
+};
+
 using NubAxisModeMap = std::unordered_map<std::string, Settings::NubAxisMode>;
 NubAxisModeMap const NUB_AXIS_MODES = {
 	{ "mouse_x", Settings::MOUSE_X },
@@ -141,31 +363,137 @@ NubClickModeMap const NUB_CLICK_MODES = {
 	{ "mouse_right", Settings::MOUSE_RIGHT }
 };
 
+// Output fed by a nub axis
+struct AxisSink {
+	enum Type : uint8_t { GAMEPAD, MOUSE_X, MOUSE_Y, SCROLL_X, SCROLL_Y, MOUSE_BTN };
+	Type type;
+	uint16_t code;		// Gamepad axis
+	int state;		// Held virtual button, -1 left, 1 right
+};
+
+struct AxisRoute {
+	static constexpr unsigned int MAX_SINKS = 4;
+	unsigned int count = 0;
+	std::array<AxisSink, MAX_SINKS> sinks;
+};
+
+// Nub axis routes are indexed by role * ROUTED_CODES + abs code
+static constexpr unsigned int ROUTED_ROLES = ROLE_RIGHT_NUB + 1;
+static constexpr unsigned int ROUTED_CODES = ABS_Y + 1;
+using AxisRoutes = std::array<AxisRoute, ROUTED_ROLES * ROUTED_CODES>;
+
+// A named, fully built set of settings, key behaviors and nub routes
+struct Profile {
+	std::string name;
+	Settings settings;
+	KeyBehaviors<FIRST_KEY, LAST_KEY> behaviors;
+	AxisRoutes routes;
+	std::unordered_map<unsigned int, Macro> macros;
+};
+using ProfileMap = std::unordered_map<std::string, Profile*>;
+
+// Daemon state handed over through the systemd fd store along with the
+// uinput devices, restored only by a build with the same layout
+struct HandoverState {
+	static constexpr uint32_t VERSION = 1;
+	uint32_t version;
+	uint32_t size;
+	char profile[64];
+	LeftRight Fn, Alt, Shift, Ctrl;
+	int32_t hatx, haty;
+	// Per key: bit 0 held, bit 1 pressed as its alternative mapping
+	std::array<uint8_t, LAST_KEY - FIRST_KEY + 1> keys;
+	// Held virtual buttons of the active profile nub routes
+	std::array<std::array<int32_t, AxisRoute::MAX_SINKS>, ROUTED_ROLES * ROUTED_CODES> buttons;
+};
+using ProfileOverrides = std::unordered_map<std::string, std::vector<std::pair<std::string, std::string>>>;
+
 void handleArgs(char const** argv, unsigned int argc, Settings& settings);
-void loadConfig(std::string const& filename, Settings& settings);
+void loadConfig(std::string const& filename, Settings& settings, ProfileOverrides* overrides = nullptr);
+void applySetting(std::string const& key, std::string const& value, Settings& settings);
+void buildBehaviors(KeyBehaviors<FIRST_KEY, LAST_KEY>& behaviors, Settings& settings);
+ProfileMap loadProfiles(Settings const& base);
+void switchProfile(std::string const& name);
+void collectRetired();
 Settings::NubAxisMode parseNubAxisMode(std::string const& str);
+std::vector<Settings::NubAxisMode> parseNubAxisModes(std::string const& str);
 Settings::NubClickMode parseNubClickMode(std::string const& str);
-void handleNubAxis(Settings::NubAxisMode mode, int value, Mouse* mouse, UinputDevice* gamepad, Settings const& settings);
-void handleNubClick(Settings::NubClickMode mode, int value, Mouse* mouse, UinputDevice* gamepad, Settings const& settings);
+void buildAxisRoutes(AxisRoutes& routes, Settings const& settings);
+void routeNubAxis(AxisRoute& route, int value, Mouse* mouse, OutputDevice* gamepad, Settings const& settings);
+void releaseAxisButtons(AxisRoutes& routes, Mouse* mouse);
+void holdAxisButton(Mouse* mouse, int state, bool held);
+void handleNubClick(Settings::NubClickMode mode, int value, Mouse* mouse, OutputDevice* gamepad, Settings const& settings);
+Profile* nubButtonProfile(unsigned int role, unsigned int code, int value);
+void configureRecorder(Settings const& settings);
+void dumpRecorder(int sig);
+void loadCalibration(std::string const& filename);
+void settleNubs();
+std::unordered_map<std::string, int> takeStoredFds();
+void storeFd(std::string const& name, int fd);
+void storeState();
+void restoreState(int fd);
+bool readKeypadState(std::array<uint8_t, LAST_KEY - FIRST_KEY + 1>& held);
+void releaseNubButtons();
+void releaseAll(OutputDevice* device);
+void saveCalibration(std::string const& filename);
 
 // Mouse movement/scroll thread handler
-void handleMouse(Mouse* mouse, Settings* settings, bool* stop);
+void handleMouse(Mouse* mouse, std::atomic<Profile*>* profile, bool* stop);
+// Key repeat thread handler
+void handleTimer(Timer* timer, bool* stop);
+void startRepeat(unsigned int code, KeyBehaviors<FIRST_KEY, LAST_KEY> const& behaviors, Settings const& settings);
+void stopRepeat(unsigned int code);
+void dispatchKey(unsigned int code, int value);
+bool debounceKey(unsigned int code, int value, Settings const& settings);
+void settleDebounce();
+void loadDebounceStats(std::string const& filename);
+std::string macroPath(std::string const& name);
+bool loadMacro(std::string const& filename, Macro& macro);
+bool saveMacro(std::string const& filename, Macro const& macro);
+void startMacro(Macro const* macro);
+void playMacros(Timer* timer, std::chrono::steady_clock::time_point now);
+void releasePlayback(Timer::Playback& p);
+void startMacroRecording(std::string const& name);
+void stopMacroRecording();
+void toggleMacroRecording(std::string const& name);
+void saveDebounceStats(std::string const& filename);
 
 struct {
 	bool stop = false;
-	UinputDevice* gamepad = nullptr;
-	UinputDevice* keyboard = nullptr;
-	KeyBehaviors<FIRST_KEY, LAST_KEY>* behaviors = nullptr;
+	OutputDevice* gamepad = nullptr;
+	OutputDevice* keyboard = nullptr;
 	Mouse* mouse = nullptr;
 	std::thread mouseThread;
-	Settings settings;
+	Timer timer;
+	std::thread timerThread;
+	// Serializes key dispatch between the input and timer threads, any
+	// thread using keyboard or gamepad must hold it
+	std::mutex dispatch;
+	Debounce debounce;
+	MacroRecorder macroRecorder;
+	// Devices are kept in the systemd fd store across restarts
+	bool handover = false;
+	// Settings from the command line, the config file is applied on copies
+	Settings base;
+	ProfileMap profiles;
+	// Active profile, swapped as a whole; replaced profiles are kept while
+	// held keys or playing macros still use them, see collectRetired()
+	std::atomic<Profile*> profile{nullptr};
+	std::vector<std::pair<Profile*, std::chrono::steady_clock::time_point>> retired;
+	// Behaviors each held key was pressed with
+	std::array<KeyBehaviors<FIRST_KEY, LAST_KEY>*, LAST_KEY - FIRST_KEY + 1> pressedWith{};
+	// Profile each held nub button was pressed with, per role and button
+	std::array<std::array<Profile*, 2>, ROUTED_ROLES> nubPressedWith{};
 	LeftRight Fn;
 	LeftRight Alt;
 	LeftRight Shift;
 	LeftRight Ctrl;
 	int hatx = 0;
 	int haty = 0;
-	int mouseBtn = 0;
+	Settings& settings() { return profile.load()->settings; }
+	// Indexed like AxisRoutes
+	std::array<NubCalibration, ROUTED_ROLES * ROUTED_CODES> calibration;
+	FlightRecorder recorder;
 } global;
 
 
@@ -175,94 +503,24 @@ void init(char const** argv, unsigned int argc) {
 		keycodes.push_back(i);
 	}
 	
-	global.keyboard = new UinputDevice("/dev/uinput", BUS_USB, "pyraInput keyboard", 1, 1, 1, {
-		{ EV_KEY, keycodes }
-	});
-
-	global.behaviors = new KeyBehaviors<FIRST_KEY, LAST_KEY>();
-	global.behaviors->gphat(KEY_UP,		BTN_DPAD_UP);
-	global.behaviors->gphat(KEY_DOWN,	BTN_DPAD_DOWN);
-	global.behaviors->gphat(KEY_LEFT,	BTN_DPAD_LEFT);
-	global.behaviors->gphat(KEY_RIGHT,	BTN_DPAD_RIGHT);
-	global.behaviors->gpmap2(KEY_LEFTALT,	BTN_START, &global.Alt.left, &global.Alt);
-	global.behaviors->gpmap2(KEY_LEFTCTRL,	BTN_SELECT, &global.Ctrl.left, &global.Ctrl);
-	global.behaviors->gpmap(KEY_HOME,	BTN_A);
-	global.behaviors->gpmap(KEY_END,	BTN_B);
-	global.behaviors->gpmap(KEY_PAGEDOWN,	BTN_X);
-	global.behaviors->gpmap(KEY_PAGEUP,	BTN_Y);
-	global.behaviors->gpmap2(KEY_RIGHTSHIFT,BTN_TL, &global.Shift.right, &global.Shift);
-	global.behaviors->gpmap2(KEY_RIGHTCTRL,	BTN_TR, &global.Ctrl.right, &global.Ctrl);
-	global.behaviors->gpmap2(KEY_RIGHTALT,	BTN_TR2, &global.Alt.right, &global.Alt);
-	global.behaviors->gpmap(KEY_INSERT,	BTN_C);  //(I)
-	global.behaviors->gpmap(KEY_DELETE,	BTN_Z);  //(II)
-	
-	global.behaviors->complex(KEY_LEFTSHIFT, [](int value) {
-		global.Shift.left = (value==1);
-		global.Shift.pressed = global.Shift.left || global.Shift.right;
-		global.keyboard->send(EV_KEY, KEY_LEFTSHIFT, value);
-	});
-	global.behaviors->complex(KEY_RIGHTMETA, [](int value) {
-		global.Fn.right = (value==1);
-		global.Fn.pressed = global.Fn.left || global.Fn.right;
-		if (global.settings.exportGamepad) {
-			global.gamepad->send(EV_KEY, BTN_TL2, value);
-			global.gamepad->send(EV_SYN, 0, 0);
+	std::unordered_map<std::string, int> stored = takeStoredFds();
+	auto adopt = [&stored](std::string const& name) {
+		auto iter = stored.find(name);
+		return iter == stored.end() ? -1 : iter->second;
+	};
+	bool adopted = adopt("keyboard") >= 0 && adopt("gamepad") >= 0 && adopt("mouse") >= 0;
+	if (!adopted) {
+		for(auto const& fd : stored) {
+			close(fd.second);
 		}
-	});
-	global.behaviors->complex(KEY_LEFTMETA, [](int value) {
-		global.Fn.left = (value==1);
-		global.Fn.pressed = global.Fn.left || global.Fn.right;
-	});
+		stored.clear();
+	}
 
-	//TODO: make the alt mapping configurable
-	global.behaviors->altmap(KEY_ESC,	&global.Fn.pressed, KEY_ESC,	KEY_SYSRQ);
-	global.behaviors->altmap(KEY_PAUSE,	&global.Fn.pressed, KEY_PAUSE,	KEY_SCALE);		global.behaviors->script(KEY_BRIGHTNESSUP, &global.settings.brightness);
-	//global.behaviors->altmap(KEY_BRIGHTNESSUP,	&global.Fn.pressed, KEY_BRIGHTNESSUP,	KEY_BRIGHTNESSDOWN);
-	global.behaviors->altmap(KEY_F11,	&global.Fn.pressed, KEY_F11,	KEY_F12);
-	global.behaviors->altmap(KEY_1,		&global.Fn.pressed, KEY_1,	KEY_F1);
-	global.behaviors->altmap(KEY_2,		&global.Fn.pressed, KEY_2,	KEY_F2);
-	global.behaviors->altmap(KEY_3,		&global.Fn.pressed, KEY_3,	KEY_F3);
-	global.behaviors->altmap(KEY_4,		&global.Fn.pressed, KEY_4,	KEY_F4);
-	global.behaviors->altmap(KEY_5,		&global.Fn.pressed, KEY_5,	KEY_F5);
-	global.behaviors->altmap(KEY_6,		&global.Fn.pressed, KEY_6,	KEY_F6);
-	global.behaviors->altmap(KEY_7,		&global.Fn.pressed, KEY_7,	KEY_F7);
-	global.behaviors->altmap(KEY_8,		&global.Fn.pressed, KEY_8,	KEY_F8);
-	global.behaviors->altmap(KEY_9,		&global.Fn.pressed, KEY_9,	KEY_F9);
-	global.behaviors->altmap(KEY_0,		&global.Fn.pressed, KEY_0,	KEY_F10);
-	global.behaviors->altmap(KEY_TAB,	&global.Fn.pressed, KEY_TAB,	KEY_CAPSLOCK);
-	global.behaviors->altmap(KEY_Q,		&global.Fn.pressed, KEY_Q,	KEY_MACRO);			// I120 // ok
-	global.behaviors->altmap(KEY_W,		&global.Fn.pressed, KEY_W,	KEY_KPCOMMA);			// I129 // ok
-	global.behaviors->altmap(KEY_E,		&global.Fn.pressed, KEY_E,	KEY_SETUP);			// I149 // ok
-	global.behaviors->altmap(KEY_R,		&global.Fn.pressed, KEY_R,	KEY_DELETEFILE);		// I154 // ok
-	global.behaviors->altmap(KEY_T,		&global.Fn.pressed, KEY_T,	KEY_CLOSECD);			// I168 // ok
-	global.behaviors->altmap(KEY_Y,		&global.Fn.pressed, KEY_Y,	KEY_ISO);			// I178 // ok
-	global.behaviors->altmap(KEY_U,		&global.Fn.pressed, KEY_U,	KEY_MOVE);			// I183 // ok
-	global.behaviors->altmap(KEY_I,		&global.Fn.pressed, KEY_I,	KEY_EDIT);			// I184 // ok
-	global.behaviors->altmap(KEY_O,		&global.Fn.pressed, KEY_O,	KEY_ALTERASE);			// I230 // ok
-	global.behaviors->altmap(KEY_P,		&global.Fn.pressed, KEY_P,	KEY_BASSBOOST);			// I217 // ok
-	global.behaviors->altmap(KEY_APOSTROPHE,	&global.Fn.pressed, KEY_APOSTROPHE,	KEY_UWB);	// I247 // ok
-	global.behaviors->altmap(KEY_A,		&global.Fn.pressed, KEY_A,	KEY_QUESTION);			// I222 // ok
-	global.behaviors->altmap(KEY_S,		&global.Fn.pressed, KEY_S,	KEY_UNKNOWN);			// I248 // ok
-	global.behaviors->altmap(KEY_D,		&global.Fn.pressed, KEY_D,	KEY_SOUND);			// I221 // ok
-	global.behaviors->altmap(KEY_F,		&global.Fn.pressed, KEY_F,	KEY_HP);			// I219 // ok
-	global.behaviors->altmap(KEY_G,		&global.Fn.pressed, KEY_G,	KEY_RO);			// I249- AB11 (89)
-	global.behaviors->altmap(KEY_H,		&global.Fn.pressed, KEY_H,	KEY_KPJPCOMMA);			// I250- JPCM (95)
-	global.behaviors->altmap(KEY_J,		&global.Fn.pressed, KEY_J,	KEY_YEN);			// I251- AE13 (124)
-	global.behaviors->altmap(KEY_K,		&global.Fn.pressed, KEY_K,	KEY_F19);			// I252- FK19 (189)
-	global.behaviors->altmap(KEY_L,		&global.Fn.pressed, KEY_L,	KEY_F24);			// I253- FK24 (194)
-	global.behaviors->altmap(KEY_COMMA,	&global.Fn.pressed, KEY_COMMA,	KEY_SEMICOLON);
-	global.behaviors->altmap(KEY_DOT,	&global.Fn.pressed, KEY_DOT,	KEY_SLASH);
-	global.behaviors->altmap(KEY_Z,		&global.Fn.pressed, KEY_Z,	KEY_EQUAL);
-	global.behaviors->altmap(KEY_X,		&global.Fn.pressed, KEY_X,	KEY_MINUS);
-	global.behaviors->altmap(KEY_C,		&global.Fn.pressed, KEY_C,	KEY_LEFTBRACE);
-	global.behaviors->altmap(KEY_V,		&global.Fn.pressed, KEY_V,	KEY_RIGHTBRACE);
-	global.behaviors->altmap(KEY_B,		&global.Fn.pressed, KEY_B,	KEY_BACKSLASH);
-	global.behaviors->altmap(KEY_N,		&global.Fn.pressed, KEY_N,	KEY_GRAVE);
-	global.behaviors->altmap(KEY_M,		&global.Fn.pressed, KEY_M,	195);			// 228- MDSW (195)
-	global.behaviors->altmap(KEY_SPACE,	&global.Fn.pressed, KEY_SPACE,	KEY_COMPOSE);
-	
+	global.keyboard = adopted ? new OutputDevice(adopt("keyboard")) : new OutputDevice("/dev/uinput", BUS_USB, "pyraInput keyboard", 1, 1, 1, {
+		{ EV_KEY, keycodes }
+	});
 
-	global.gamepad = new UinputDevice("/dev/uinput", BUS_USB, "pyraInput Gamepad", 1, 1, 1, {
+	global.gamepad = adopted ? new OutputDevice(adopt("gamepad")) : new OutputDevice("/dev/uinput", BUS_USB, "pyraInput Gamepad", 1, 1, 1, {
 		{ EV_KEY, {
 			BTN_A, BTN_B, BTN_X, BTN_Y, 
 			BTN_TL, BTN_TR, BTN_TL2, BTN_TR2,
@@ -272,101 +530,113 @@ void init(char const** argv, unsigned int argc) {
 		{ EV_ABS, { ABS_HAT0X, ABS_HAT0Y, ABS_X, ABS_Y, ABS_RX, ABS_RY } }
 	});
 	global.mouse = new Mouse {
-		UinputDevice("/dev/uinput", BUS_USB, "pyraInput Mouse", 1, 1, 1, {
+		adopted ? OutputDevice(adopt("mouse")) : OutputDevice("/dev/uinput", BUS_USB, "pyraInput Mouse", 1, 1, 1, {
 			{ EV_KEY, { BTN_LEFT, BTN_RIGHT } },
 	       { EV_REL, { REL_X, REL_Y, REL_HWHEEL, REL_WHEEL } }
-		}), 0, 0, 0, 0, {}, {}
+		}), 0, 0, 0, 0, {}, {}, {}
 	};
-	global.mouseThread = std::move(std::thread(handleMouse, global.mouse, &global.settings, &global.stop));
+	global.gamepad->id = FlightRecorder::DEVICE_GAMEPAD;
+	global.mouse->device.id = FlightRecorder::DEVICE_MOUSE;
 
-	handleArgs(argv, argc, global.settings);
+	handleArgs(argv, argc, global.base);
 	
-	global.settings.brightness.normal = "/usr/share/pyra/scripts/pyra-brightkey.sh screen up";
-	global.settings.brightness.Shift = "/usr/share/pyra/scripts/pyra-brightkey.sh screen down";
-	global.settings.brightness.Fn = "/usr/share/pyra/scripts/pyra-brightkey.sh key up";
-	global.settings.brightness.FnShift = "/usr/share/pyra/scripts/pyra-brightkey.sh key down";
+	global.base.brightness.normal = "/usr/share/pyra/scripts/pyra-brightkey.sh screen up";
+	global.base.brightness.Shift = "/usr/share/pyra/scripts/pyra-brightkey.sh screen down";
+	global.base.brightness.Fn = "/usr/share/pyra/scripts/pyra-brightkey.sh key up";
+	global.base.brightness.FnShift = "/usr/share/pyra/scripts/pyra-brightkey.sh key down";
 
-	if(!global.settings.configFile.empty()) {
-		loadConfig(global.settings.configFile, global.settings);
+	global.profiles = loadProfiles(global.base);
+	global.profile = global.profiles.at("default");
+
+	if (adopted) {
+		if (adopt("state") >= 0) {
+			restoreState(adopt("state"));
+		} else {
+			// No state from a clean shutdown: nothing can be known to be held
+			releaseAll(global.keyboard);
+			releaseAll(global.gamepad);
+			releaseAll(&global.mouse->device);
+		}
+	} else {
+		storeFd("keyboard", global.keyboard->fd());
+		storeFd("gamepad", global.gamepad->fd());
+		storeFd("mouse", global.mouse->device.fd());
+	}
+	global.mouseThread = std::move(std::thread(handleMouse, global.mouse, &global.profile, &global.stop));
+	global.timerThread = std::move(std::thread(handleTimer, &global.timer, &global.stop));
+
+	configureRecorder(global.settings());
+	for(int sig : { SIGQUIT, SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT }) {
+		signal(sig, dumpRecorder);
+	}
+
+	if(global.settings().nubCalibration && !global.settings().calibrationFile.empty()) {
+		loadCalibration(global.settings().calibrationFile);
+	}
+	if(!global.settings().debounceStatsFile.empty()) {
+		loadDebounceStats(global.settings().debounceStatsFile);
 	}
 }
 
-void handle(input_event const& e, unsigned int role) {
+void handle(input_event const& ev, unsigned int role) {
+	input_event e = ev;
+	global.recorder.record(FlightRecorder::INPUT, role, e.type, e.code, e.value, FlightRecorder::ORIGIN_NONE, 0);
 	switch(e.type) {
 	case EV_ABS:
-		if (role == ROLE_LEFT_NUB) {
-			switch(e.code) {
-			case ABS_X:
-				if (global.settings.exportGamepad && (e.value>global.settings.joyDeadzone||e.value<-global.settings.joyDeadzone)) {
-					global.gamepad->send(EV_ABS, ABS_X, e.value);
-					global.gamepad->send(EV_SYN, 0, 0);
-				}
-				handleNubAxis(global.settings.leftNubModeX, e.value, global.mouse, global.gamepad, global.settings);
-				break;
-			case ABS_Y:
-				if (global.settings.exportGamepad && (e.value>global.settings.joyDeadzone||e.value<-global.settings.joyDeadzone)) {
-					global.gamepad->send(EV_ABS, ABS_Y, e.value);
-					global.gamepad->send(EV_SYN, 0, 0);
-				}
-				handleNubAxis(global.settings.leftNubModeY, e.value, global.mouse, global.gamepad, global.settings);
-				break;
-			default: break;
-			};
-		} else if (role == ROLE_RIGHT_NUB) {
-			switch(e.code) {
-			case ABS_X:
-				if (global.settings.exportGamepad && (e.value>global.settings.joyDeadzone||e.value<-global.settings.joyDeadzone)) {
-					global.gamepad->send(EV_ABS, ABS_RX, e.value);
-					global.gamepad->send(EV_SYN, 0, 0);
-				}
-				handleNubAxis(global.settings.rightNubModeX, e.value, global.mouse, global.gamepad, global.settings);
-				break;
-			case ABS_Y:
-				if (global.settings.exportGamepad && (e.value>global.settings.joyDeadzone||e.value<-global.settings.joyDeadzone)) {
-					global.gamepad->send(EV_ABS, ABS_RY, e.value);
-					global.gamepad->send(EV_SYN, 0, 0);
-				}
-				handleNubAxis(global.settings.rightNubModeY, e.value, global.mouse, global.gamepad, global.settings);
-				break;
-			default: break;
-		};
+		if (role < ROUTED_ROLES && e.code < ROUTED_CODES) {
+			std::lock_guard<std::mutex> lk(global.dispatch);
+			Profile* profile = global.profile.load();
+			unsigned int axis = role * ROUTED_CODES + e.code;
+			e.value = global.calibration[axis].correct(e.value, profile->settings);
+			routeNubAxis(profile->routes[axis], e.value, global.mouse, global.gamepad, profile->settings);
 		}
 		break;
 	case EV_KEY:
 		switch(e.code) {
 		case BTN_LEFT: // mouse click
 		case BTN_RIGHT:
-		case BTN_MIDDLE:
+		case BTN_MIDDLE: {
 			// TODO : configure this
-			if (role == ROLE_LEFT_NUB && global.settings.exportMouse)
+			std::lock_guard<std::mutex> lk(global.dispatch);
+			Settings const& settings = nubButtonProfile(role, e.code, e.value)->settings;
+			setOrigin(FlightRecorder::ORIGIN_NUB_BUTTON);
+			std::lock_guard<std::mutex> mlk(global.mouse->mutex);
+			if (role == ROLE_LEFT_NUB && settings.exportMouse)
 				global.mouse->device.send(EV_KEY, BTN_LEFT, e.value);
-			else if (role == ROLE_RIGHT_NUB && global.settings.exportMouse)
+			else if (role == ROLE_RIGHT_NUB && settings.exportMouse)
 				global.mouse->device.send(EV_KEY, BTN_RIGHT, e.value);
 			/*else
 				global.mouse->device.send(EV_KEY, e.code, e.value);*/
 			global.mouse->device.send(EV_SYN, 0, 0);
+			}
 			break;
 		case BTN_THUMBL:
-		case BTN_THUMBR:
-			if (role == ROLE_LEFT_NUB && global.settings.exportMouse) {
+		case BTN_THUMBR: {
+			std::lock_guard<std::mutex> lk(global.dispatch);
+			Settings const& settings = nubButtonProfile(role, e.code, e.value)->settings;
+			if (role == ROLE_LEFT_NUB && settings.exportMouse) {
 				std::cout << "left nub click\n";
-				handleNubClick(global.settings.leftNubClickMode, e.value, global.mouse, global.gamepad, global.settings);
-				if (global.settings.exportGamepad) {
+				handleNubClick(settings.leftNubClickMode, e.value, global.mouse, global.gamepad, settings);
+				if (settings.exportGamepad) {
 					global.gamepad->send(EV_KEY, BTN_THUMBL, e.value);
 					global.gamepad->send(EV_SYN, 0, 0);
 				}
-			} else if (role == ROLE_RIGHT_NUB && global.settings.exportMouse) {
+			} else if (role == ROLE_RIGHT_NUB && settings.exportMouse) {
 				std::cout << "right nub click\n";
-				handleNubClick(global.settings.rightNubClickMode, e.value, global.mouse, global.gamepad, global.settings);
-				if (global.settings.exportGamepad) {
+				handleNubClick(settings.rightNubClickMode, e.value, global.mouse, global.gamepad, settings);
+				if (settings.exportGamepad) {
 					global.gamepad->send(EV_KEY, BTN_THUMBR, e.value);
 					global.gamepad->send(EV_SYN, 0, 0);
 				}
 			}
+			}
 			break;
-		default: 
-			global.behaviors->handle(e.code, e.value);
-			global.keyboard->send(EV_SYN, 0, 0);
+		default: {
+			std::lock_guard<std::mutex> lk(global.dispatch);
+			if ((role == ROLE_KEYBOARD || role == ROLE_GPIO) && !debounceKey(e.code, e.value, global.settings()))
+				break;
+			dispatchKey(e.code, e.value);
+			}
 			break;
 		}
 		break;
@@ -383,26 +653,168 @@ void handle(input_event const& e, unsigned int role) {
 }
 
 void destroy() {
+	if(!global.settings().debounceStatsFile.empty()) {
+		saveDebounceStats(global.settings().debounceStatsFile);
+	}
 	global.stop = true;
 	global.mouse->signal.notify_all();
+	global.mouseThread.join();
+	{
+		std::lock_guard<std::mutex> lk(global.timer.mutex);
+		global.timer.signal.notify_all();
+	}
+	global.timerThread.join();
+	// The mouse thread feeds the calibration too
+	if(global.settings().nubCalibration && !global.settings().calibrationFile.empty()) {
+		saveCalibration(global.settings().calibrationFile);
+	}
+	if(global.handover) {
+		// Only held keys and axis buttons are handed over, the next instance
+		// cannot tell when anything else is let go of
+		for(auto& p : global.timer.playbacks) {
+			releasePlayback(p);
+		}
+		releaseNubButtons();
+		storeState();
+		global.keyboard->keep = true;
+		global.gamepad->keep = true;
+		global.mouse->device.keep = true;
+	}
 
+	if(global.mouse) {
+		delete global.mouse;
+	}
 	if(global.gamepad) {
 		delete global.gamepad;
 	}
 	if(global.keyboard) {
 		delete global.keyboard;
 	}
-	if(global.behaviors) {
-		delete global.behaviors;
+	for(auto& p : global.profiles) {
+		delete p.second;
+	}
+	for(auto& p : global.retired) {
+		delete p.first;
 	}
-
-	global.mouseThread.join();
 }
 
 void user1() {
-	loadConfig(global.settings.configFile, global.settings);
+	std::string active = global.profile.load()->name;
+	releaseAxisButtons(global.profile.load()->routes, global.mouse);
+	ProfileMap profiles = loadProfiles(global.base);
+	auto iter = profiles.find(active);
+	global.profile = (iter != profiles.end()) ? iter->second : profiles.at("default");
+	std::lock_guard<std::mutex> lk(global.dispatch);
+	for(auto& p : global.profiles) {
+		global.retired.emplace_back(p.second, std::chrono::steady_clock::now());
+	}
+	global.profiles = std::move(profiles);
+	configureRecorder(global.settings());
+	collectRetired();
 }
+// Control commands: "record <macro>", "stop", "profile <name>" or "<name>"
 void user2() {
+	std::string const& filename = global.profiles.at("default")->settings.profileFile;
+	std::ifstream file(filename);
+	std::string command, arg;
+	if(!file || !(file >> command)) {
+		std::cerr << "ERROR: Could not read profile from " << filename << std::endl;
+		return;
+	}
+	file >> arg;
+	if(command == "record") {
+		startMacroRecording(arg);
+	} else if(command == "stop") {
+		stopMacroRecording();
+	} else if(command == "profile") {
+		switchProfile(arg);
+	} else {
+		switchProfile(command);
+	}
+}
+
+void buildBehaviors(KeyBehaviors<FIRST_KEY, LAST_KEY>& behaviors, Settings& settings) {
+	behaviors.bind(&settings);
+	behaviors.gphat(KEY_UP,		BTN_DPAD_UP);
+	behaviors.gphat(KEY_DOWN,	BTN_DPAD_DOWN);
+	behaviors.gphat(KEY_LEFT,	BTN_DPAD_LEFT);
+	behaviors.gphat(KEY_RIGHT,	BTN_DPAD_RIGHT);
+	behaviors.gpmap2(KEY_LEFTALT,	BTN_START, &global.Alt.left, &global.Alt);
+	behaviors.gpmap2(KEY_LEFTCTRL,	BTN_SELECT, &global.Ctrl.left, &global.Ctrl);
+	behaviors.gpmap(KEY_HOME,	BTN_A);
+	behaviors.gpmap(KEY_END,	BTN_B);
+	behaviors.gpmap(KEY_PAGEDOWN,	BTN_X);
+	behaviors.gpmap(KEY_PAGEUP,	BTN_Y);
+	behaviors.gpmap2(KEY_RIGHTSHIFT,BTN_TL, &global.Shift.right, &global.Shift);
+	behaviors.gpmap2(KEY_RIGHTCTRL,	BTN_TR, &global.Ctrl.right, &global.Ctrl);
+	behaviors.gpmap2(KEY_RIGHTALT,	BTN_TR2, &global.Alt.right, &global.Alt);
+	behaviors.gpmap(KEY_INSERT,	BTN_C);  //(I)
+	behaviors.gpmap(KEY_DELETE,	BTN_Z);  //(II)
+	
+	behaviors.complex(KEY_LEFTSHIFT, [](int value) {
+		global.Shift.left = (value==1);
+		global.Shift.pressed = global.Shift.left || global.Shift.right;
+		global.keyboard->send(EV_KEY, KEY_LEFTSHIFT, value);
+	});
+	behaviors.complex(KEY_RIGHTMETA, [&settings](int value) {
+		global.Fn.right = (value==1);
+		global.Fn.pressed = global.Fn.left || global.Fn.right;
+		if (settings.exportGamepad) {
+			global.gamepad->send(EV_KEY, BTN_TL2, value);
+			global.gamepad->send(EV_SYN, 0, 0);
+		}
+	});
+	behaviors.complex(KEY_LEFTMETA, [](int value) {
+		global.Fn.left = (value==1);
+		global.Fn.pressed = global.Fn.left || global.Fn.right;
+	});
+
+	//TODO: make the alt mapping configurable
+	behaviors.altmap(KEY_ESC,	&global.Fn.pressed, KEY_ESC,	KEY_SYSRQ);
+	behaviors.altmap(KEY_PAUSE,	&global.Fn.pressed, KEY_PAUSE,	KEY_SCALE);		behaviors.script(KEY_BRIGHTNESSUP, &settings.brightness);
+	//behaviors.altmap(KEY_BRIGHTNESSUP,	&global.Fn.pressed, KEY_BRIGHTNESSUP,	KEY_BRIGHTNESSDOWN);
+	behaviors.altmap(KEY_F11,	&global.Fn.pressed, KEY_F11,	KEY_F12);
+	behaviors.altmap(KEY_1,		&global.Fn.pressed, KEY_1,	KEY_F1);
+	behaviors.altmap(KEY_2,		&global.Fn.pressed, KEY_2,	KEY_F2);
+	behaviors.altmap(KEY_3,		&global.Fn.pressed, KEY_3,	KEY_F3);
+	behaviors.altmap(KEY_4,		&global.Fn.pressed, KEY_4,	KEY_F4);
+	behaviors.altmap(KEY_5,		&global.Fn.pressed, KEY_5,	KEY_F5);
+	behaviors.altmap(KEY_6,		&global.Fn.pressed, KEY_6,	KEY_F6);
+	behaviors.altmap(KEY_7,		&global.Fn.pressed, KEY_7,	KEY_F7);
+	behaviors.altmap(KEY_8,		&global.Fn.pressed, KEY_8,	KEY_F8);
+	behaviors.altmap(KEY_9,		&global.Fn.pressed, KEY_9,	KEY_F9);
+	behaviors.altmap(KEY_0,		&global.Fn.pressed, KEY_0,	KEY_F10);
+	behaviors.altmap(KEY_TAB,	&global.Fn.pressed, KEY_TAB,	KEY_CAPSLOCK);
+	behaviors.altmap(KEY_Q,		&global.Fn.pressed, KEY_Q,	KEY_MACRO);			// I120 // ok
+	behaviors.altmap(KEY_W,		&global.Fn.pressed, KEY_W,	KEY_KPCOMMA);			// I129 // ok
+	behaviors.altmap(KEY_E,		&global.Fn.pressed, KEY_E,	KEY_SETUP);			// I149 // ok
+	behaviors.altmap(KEY_R,		&global.Fn.pressed, KEY_R,	KEY_DELETEFILE);		// I154 // ok
+	behaviors.altmap(KEY_T,		&global.Fn.pressed, KEY_T,	KEY_CLOSECD);			// I168 // ok
+	behaviors.altmap(KEY_Y,		&global.Fn.pressed, KEY_Y,	KEY_ISO);			// I178 // ok
+	behaviors.altmap(KEY_U,		&global.Fn.pressed, KEY_U,	KEY_MOVE);			// I183 // ok
+	behaviors.altmap(KEY_I,		&global.Fn.pressed, KEY_I,	KEY_EDIT);			// I184 // ok
+	behaviors.altmap(KEY_O,		&global.Fn.pressed, KEY_O,	KEY_ALTERASE);			// I230 // ok
+	behaviors.altmap(KEY_P,		&global.Fn.pressed, KEY_P,	KEY_BASSBOOST);			// I217 // ok
+	behaviors.altmap(KEY_APOSTROPHE,	&global.Fn.pressed, KEY_APOSTROPHE,	KEY_UWB);	// I247 // ok
+	behaviors.altmap(KEY_A,		&global.Fn.pressed, KEY_A,	KEY_QUESTION);			// I222 // ok
+	behaviors.altmap(KEY_S,		&global.Fn.pressed, KEY_S,	KEY_UNKNOWN);			// I248 // ok
+	behaviors.altmap(KEY_D,		&global.Fn.pressed, KEY_D,	KEY_SOUND);			// I221 // ok
+	behaviors.altmap(KEY_F,		&global.Fn.pressed, KEY_F,	KEY_HP);			// I219 // ok
+	behaviors.altmap(KEY_G,		&global.Fn.pressed, KEY_G,	KEY_RO);			// I249- AB11 (89)
+	behaviors.altmap(KEY_H,		&global.Fn.pressed, KEY_H,	KEY_KPJPCOMMA);			// I250- JPCM (95)
+	behaviors.altmap(KEY_J,		&global.Fn.pressed, KEY_J,	KEY_YEN);			// I251- AE13 (124)
+	behaviors.altmap(KEY_K,		&global.Fn.pressed, KEY_K,	KEY_F19);			// I252- FK19 (189)
+	behaviors.altmap(KEY_L,		&global.Fn.pressed, KEY_L,	KEY_F24);			// I253- FK24 (194)
+	behaviors.altmap(KEY_COMMA,	&global.Fn.pressed, KEY_COMMA,	KEY_SEMICOLON);
+	behaviors.altmap(KEY_DOT,	&global.Fn.pressed, KEY_DOT,	KEY_SLASH);
+	behaviors.altmap(KEY_Z,		&global.Fn.pressed, KEY_Z,	KEY_EQUAL);
+	behaviors.altmap(KEY_X,		&global.Fn.pressed, KEY_X,	KEY_MINUS);
+	behaviors.altmap(KEY_C,		&global.Fn.pressed, KEY_C,	KEY_LEFTBRACE);
+	behaviors.altmap(KEY_V,		&global.Fn.pressed, KEY_V,	KEY_RIGHTBRACE);
+	behaviors.altmap(KEY_B,		&global.Fn.pressed, KEY_B,	KEY_BACKSLASH);
+	behaviors.altmap(KEY_N,		&global.Fn.pressed, KEY_N,	KEY_GRAVE);
+	behaviors.altmap(KEY_M,		&global.Fn.pressed, KEY_M,	195);			// 228- MDSW (195)
+	behaviors.altmap(KEY_SPACE,	&global.Fn.pressed, KEY_SPACE,	KEY_COMPOSE);
 }
 
 void handleArgs(char const** argv, unsigned int argc, Settings& settings) {
@@ -484,17 +896,65 @@ SettingHandlerMap const SETTING_HANDLERS = {
 	{ "nubs.deadzone", [](std::string const& value, Settings& settings) {
 		settings.joyDeadzone = std::stoi(value);
 	} },
+	{ "nubs.calibration", [](std::string const& value, Settings& settings) {
+		settings.nubCalibration = (value != "0");
+	} },
+	{ "nubs.calibration.window", [](std::string const& value, Settings& settings) {
+		settings.nubCalibrationWindow = std::stoi(value);
+	} },
+	{ "nubs.calibration.still", [](std::string const& value, Settings& settings) {
+		settings.nubCalibrationStill = std::stoi(value);
+	} },
+	{ "nubs.calibration.settle", [](std::string const& value, Settings& settings) {
+		settings.nubCalibrationSettle = std::stoi(value);
+	} },
+	{ "nubs.calibration.rate", [](std::string const& value, Settings& settings) {
+		settings.nubCalibrationRate = std::stoi(value);
+	} },
+	{ "nubs.calibration.file", [](std::string const& value, Settings& settings) {
+		settings.calibrationFile = value;
+	} },
 	{ "nubs.left.x", [](std::string const& value, Settings& settings) {
-		settings.leftNubModeX = parseNubAxisMode(value);
+		settings.leftNubModeX = parseNubAxisModes(value);
 	} },
 	{ "nubs.left.y", [](std::string const& value, Settings& settings) {
-		settings.leftNubModeY = parseNubAxisMode(value);
+		settings.leftNubModeY = parseNubAxisModes(value);
 	} },
 	{ "nubs.right.x", [](std::string const& value, Settings& settings) {
-		settings.rightNubModeX = parseNubAxisMode(value);
+		settings.rightNubModeX = parseNubAxisModes(value);
 	} },
 	{ "nubs.right.y", [](std::string const& value, Settings& settings) {
-		settings.rightNubModeY = parseNubAxisMode(value);
+		settings.rightNubModeY = parseNubAxisModes(value);
+	} },
+	{ "profile.file", [](std::string const& value, Settings& settings) {
+		settings.profileFile = value;
+	} },
+	{ "recorder.enable", [](std::string const& value, Settings& settings) {
+		settings.recorderEnable = (value != "0");
+	} },
+	{ "recorder.file", [](std::string const& value, Settings& settings) {
+		settings.recorderFile = value;
+	} },
+	{ "keyboard.repeat", [](std::string const& value, Settings& settings) {
+		settings.keyRepeat = (value != "0");
+	} },
+	{ "keyboard.repeat.delay", [](std::string const& value, Settings& settings) {
+		settings.repeatDelay[Settings::REPEAT_KEYS] = std::stoi(value);
+	} },
+	{ "keyboard.repeat.rate", [](std::string const& value, Settings& settings) {
+		settings.repeatRate[Settings::REPEAT_KEYS] = std::stoi(value);
+	} },
+	{ "keyboard.repeat.navigation.delay", [](std::string const& value, Settings& settings) {
+		settings.repeatDelay[Settings::REPEAT_NAVIGATION] = std::stoi(value);
+	} },
+	{ "keyboard.repeat.navigation.rate", [](std::string const& value, Settings& settings) {
+		settings.repeatRate[Settings::REPEAT_NAVIGATION] = std::stoi(value);
+	} },
+	{ "keyboard.debounce", [](std::string const& value, Settings& settings) {
+		settings.debounceWindow = std::stoi(value);
+	} },
+	{ "keyboard.debounce.stats", [](std::string const& value, Settings& settings) {
+		settings.debounceStatsFile = value;
 	} },
 	{ "nubs.left.click", [](std::string const& value, Settings& settings) {
 		settings.leftNubClickMode = parseNubClickMode(value);
@@ -504,9 +964,10 @@ SettingHandlerMap const SETTING_HANDLERS = {
 	} }
 };
 
-void loadConfig(std::string const& filename, Settings& settings) {
+void loadConfig(std::string const& filename, Settings& settings, ProfileOverrides* overrides) {
 	std::regex re("^([\\w.]+)\\s*=\\s*(.*)$");
 	std::regex emptyRe("^\\s*$");
+	std::regex profileRe("^profile\\.(\\w+)\\.([\\w.]+)$");
 	std::ifstream configFile(filename);
 	
 	if(!configFile) {
@@ -523,12 +984,11 @@ void loadConfig(std::string const& filename, Settings& settings) {
 			std::string key = match[1];
 			std::string value = match[2];
 			std::transform(key.begin(), key.end(), key.begin(), tolower);
-			auto iter = SETTING_HANDLERS.find(key);
-			if(iter == SETTING_HANDLERS.end()) {
-				std::cout << "WARNING: Unknown setting in config file: " 
-				<< key << std::endl;
+			std::smatch profileMatch;
+			if(overrides && std::regex_match(key, profileMatch, profileRe)) {
+				(*overrides)[profileMatch[1]].emplace_back(profileMatch[2], value);
 			} else {
-				iter->second(value, settings);
+				applySetting(key, value, settings);
 			}
 		} else {
 			std::cerr << "Invalid line in config file: " << line << std::endl;
@@ -536,6 +996,100 @@ void loadConfig(std::string const& filename, Settings& settings) {
 	}
 }
 
+void applySetting(std::string const& key, std::string const& value, Settings& settings) {
+	static std::regex const macroRe("^macro\\.(\\d+)$");
+	std::smatch match;
+	auto iter = SETTING_HANDLERS.find(key);
+	if(iter == SETTING_HANDLERS.end() && std::regex_match(key, match, macroRe) && std::stoul(match[1]) <= LAST_KEY) {
+		settings.macros[std::stoul(match[1])] = value;
+	} else if(iter == SETTING_HANDLERS.end()) {
+		std::cout << "WARNING: Unknown setting in config file: " 
+		<< key << std::endl;
+	} else {
+		iter->second(value, settings);
+	}
+}
+
+ProfileMap loadProfiles(Settings const& base) {
+	Settings settings(base);
+	ProfileOverrides overrides;
+	if(!base.configFile.empty()) {
+		loadConfig(base.configFile, settings, &overrides);
+	}
+
+	ProfileMap profiles;
+	overrides["default"];
+	for(auto const& o : overrides) {
+		Profile* p = new Profile { o.first, settings, {} };
+		for(auto const& kv : o.second) {
+			applySetting(kv.first, kv.second, p->settings);
+		}
+		buildBehaviors(p->behaviors, p->settings);
+		buildAxisRoutes(p->routes, p->settings);
+		for(auto const& m : p->settings.macros) {
+			std::string path = macroPath(m.second);
+			if(path.empty())
+				continue;
+			// Bound before it is recorded too, so that Fn+Ctrl can record it
+			if(access(path.c_str(), F_OK) == 0)
+				loadMacro(path, p->macros[m.first]);
+			p->behaviors.macro(m.first, &p->macros[m.first]);
+		}
+		profiles[o.first] = p;
+	}
+	return profiles;
+}
+
+// Free replaced profiles nothing refers to anymore, the caller holds
+// global.dispatch. Other threads only use the active profile transiently,
+// the grace period covers one that loaded it just before the swap.
+void collectRetired() {
+	static constexpr auto GRACE = std::chrono::seconds(1);
+	auto now = std::chrono::steady_clock::now();
+	std::lock_guard<std::mutex> lk(global.timer.mutex);
+	auto inUse = [](Profile* p) {
+		for(auto* with : global.pressedWith) {
+			if(with == &p->behaviors)
+				return true;
+		}
+		for(auto const& role : global.nubPressedWith) {
+			for(auto* with : role) {
+				if(with == p)
+					return true;
+			}
+		}
+		for(auto const& playback : global.timer.playbacks) {
+			for(auto const& m : p->macros) {
+				if(playback.macro == &m.second)
+					return true;
+			}
+		}
+		return false;
+	};
+	auto end = std::remove_if(global.retired.begin(), global.retired.end(), [&](std::pair<Profile*, std::chrono::steady_clock::time_point> const& r) {
+		if(now - r.second < GRACE || inUse(r.first))
+			return false;
+		delete r.first;
+		return true;
+	});
+	global.retired.erase(end, global.retired.end());
+}
+
+void switchProfile(std::string const& name) {
+	std::string s(name);
+	std::transform(s.begin(), s.end(), s.begin(), tolower);
+	auto iter = global.profiles.find(s);
+	if(iter == global.profiles.end()) {
+		std::cerr << "WARNING: Unknown profile " << name << std::endl;
+		return;
+	}
+	// Nub state is not per key: release what the old routes were holding
+	releaseAxisButtons(global.profile.load()->routes, global.mouse);
+	global.mouse->dx = global.mouse->dy = global.mouse->dwx = global.mouse->dwy = 0;
+	global.profile = iter->second;
+	std::cout << "Switched to profile " << s << std::endl;
+}
+
 Settings::NubAxisMode parseNubAxisMode(std::string const& str) {
 	std::string s(str);
 	std::transform(s.begin(), s.end(), s.begin(), tolower);
@@ -547,6 +1101,18 @@ Settings::NubAxisMode parseNubAxisMode(std::string const& str) {
 	}
 }
 
+std::vector<Settings::NubAxisMode> parseNubAxisModes(std::string const& str) {
+	std::vector<Settings::NubAxisMode> modes;
+	std::stringstream ss(str);
+	std::string mode;
+	while(std::getline(ss, mode, ',')) {
+		mode.erase(std::remove_if(mode.begin(), mode.end(), isspace), mode.end());
+		if(!mode.empty())
+			modes.push_back(parseNubAxisMode(mode));
+	}
+	return modes;
+}
+
 Settings::NubClickMode parseNubClickMode(std::string const& str) {
 	std::string s(str);
 	std::transform(s.begin(), s.end(), s.begin(), tolower);
@@ -558,57 +1124,551 @@ Settings::NubClickMode parseNubClickMode(std::string const& str) {
 	}
 }
 
-void handleNubAxis(Settings::NubAxisMode mode, int value, Mouse* mouse, UinputDevice* gamepad, Settings const& settings) {
-	switch(mode) {
-	case Settings::MOUSE_X:
-		mouse->dx = value;
-		if(mouse->dx > settings.mouseDeadzone || mouse->dx < -settings.mouseDeadzone)
-			mouse->signal.notify_all();
-		break;
-	case Settings::MOUSE_Y:
-		mouse->dy = value;
-		if(mouse->dy > settings.mouseDeadzone || mouse->dy < -settings.mouseDeadzone)
-			mouse->signal.notify_all();
-		break;
-	case Settings::SCROLL_X:
-		mouse->dwx = value;
-		if(mouse->dwx > settings.mouseDeadzone || mouse->dwx < -settings.mouseDeadzone)
-			mouse->signal.notify_all();
-		break;
-	case Settings::SCROLL_Y:
-		mouse->dwy = value;
-		if(mouse->dwy > settings.mouseDeadzone  || mouse->dwy < -settings.mouseDeadzone)
-			mouse->signal.notify_all();
-		break;
-	case Settings::MOUSE_BTN: {
-		int new_val = 0;
-		if (value < -settings.mouseClickDeadzone) 
-			new_val = -1;
-		else if (value > settings.mouseClickDeadzone) 
-			new_val = 1;
-		if (global.mouseBtn!=new_val && global.settings.exportMouse) {
-			if (global.mouseBtn == -1) 
-				mouse->device.send(EV_KEY, BTN_LEFT, 0);
-			else if (global.mouseBtn == 1) 
-				mouse->device.send(EV_KEY, BTN_RIGHT, 0);
-			if (new_val == -1 )
-				mouse->device.send(EV_KEY, BTN_LEFT, 1);
-			else if (new_val == 1 )
-				mouse->device.send(EV_KEY, BTN_RIGHT, 1);
-			mouse->device.send(EV_SYN, 0, 0);
-			global.mouseBtn=new_val;
+int NubCalibration::correct(int value, Settings const& settings) {
+	if(!settings.nubCalibration)
+		return value;
+	int delta = (value - last) * CALIBRATION_ONE;
+	int absdelta = delta < 0 ? -delta : delta;
+	last = value;
+	if(absdelta > std::max(settings.nubCalibrationStill * CALIBRATION_ONE, 2 * noise)) {
+		movedAt = std::chrono::steady_clock::now();
+		return value - center / CALIBRATION_ONE;
+	}
+	if(learn(settings))
+		noise += (absdelta - noise) / (1 << settings.nubCalibrationRate);
+	return value - center / CALIBRATION_ONE;
+}
+
+int NubCalibration::settle(Settings const& settings) {
+	if(settings.nubCalibration)
+		learn(settings);
+	return last - center / CALIBRATION_ONE;
+}
+
+// Only learn while the nub is still: at once inside the deadzone, and
+// outside of it only once it did not move for a while, so a deliberate push
+// is not absorbed into the center
+bool NubCalibration::learn(Settings const& settings) {
+	int dev = last * CALIBRATION_ONE - center;
+	int absdev = dev < 0 ? -dev : dev;
+	if(absdev > settings.mouseDeadzone * CALIBRATION_ONE
+	 && (absdev > settings.nubCalibrationWindow * CALIBRATION_ONE
+	  || std::chrono::steady_clock::now() - movedAt < std::chrono::milliseconds(settings.nubCalibrationSettle)))
+		return false;
+	center += dev / (1 << settings.nubCalibrationRate);
+	return true;
+}
+
+// Nubs resting off-center send no more readings, so the mouse thread feeds
+// the last ones again while it runs
+void settleNubs() {
+	std::lock_guard<std::mutex> lk(global.dispatch);
+	Profile* profile = global.profile.load();
+	for(unsigned int axis = 0; axis < global.calibration.size(); ++axis) {
+		NubCalibration& c = global.calibration[axis];
+		int before = c.last - c.center / NubCalibration::CALIBRATION_ONE;
+		int value = c.settle(profile->settings);
+		if(value != before)
+			routeNubAxis(profile->routes[axis], value, global.mouse, global.gamepad, profile->settings);
+	}
+}
+
+void loadCalibration(std::string const& filename) {
+	std::ifstream file(filename);
+	if(!file)
+		return;
+	for(auto& c : global.calibration) {
+		int center, noise;
+		if(!(file >> center >> noise)) {
+			std::cerr << "WARNING: Invalid calibration file " << filename << std::endl;
+			global.calibration.fill(NubCalibration());
+			return;
+		}
+		c.center = center;
+		c.noise = noise;
+	}
+}
+
+void saveCalibration(std::string const& filename) {
+	std::ofstream file(filename);
+	if(!file) {
+		std::cerr << "ERROR: Could not write calibration file " << filename << std::endl;
+		return;
+	}
+	for(auto const& c : global.calibration) {
+		file << c.center << " " << c.noise << std::endl;
+	}
+}
+
+void FlightRecorder::record(uint8_t direction, uint8_t source, uint16_t type, uint16_t code, int32_t value, uint8_t origin, uint8_t detail) {
+	if(!enabled)
+		return;
+	uint32_t sequence = next.fetch_add(1, std::memory_order_relaxed);
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	records[sequence & (CAPACITY - 1)] = Record {
+		uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec, sequence,
+		type, code, value, direction, source, origin, detail
+	};
+}
+
+bool FlightRecorder::dump() const {
+	if(!path[0])
+		return false;
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if(fd < 0)
+		return false;
+	Header header = { { 'P', 'Y', 'R', 'A', 'R', 'E', 'C', '1' }, 1, sizeof(Record), CAPACITY, next.load() };
+	bool ok = write(fd, &header, sizeof(header)) == sizeof(header)
+	       && write(fd, records.data(), sizeof(records)) == sizeof(records);
+	close(fd);
+	return ok;
+}
+
+OutputDevice::OutputDevice(std::string const& devnode, unsigned int bustype, std::string const& name, unsigned int vendor, unsigned int product, unsigned int version, Events const& events) {
+	_fd = open(devnode.c_str(), O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+	if(_fd < 0) {
+		std::cerr << "ERROR: Could not open " << devnode << std::endl;
+		return;
+	}
+	uinput_user_dev dev;
+	memset(&dev, 0, sizeof(dev));
+	strncpy(dev.name, name.c_str(), UINPUT_MAX_NAME_SIZE - 1);
+	dev.id.bustype = bustype;
+	dev.id.vendor = vendor;
+	dev.id.product = product;
+	dev.id.version = version;
+	for(auto const& e : events) {
+		ioctl(_fd, UI_SET_EVBIT, e.first);
+		for(auto code : e.second) {
+			switch(e.first) {
+			case EV_KEY:
+				ioctl(_fd, UI_SET_KEYBIT, code);
+				break;
+			case EV_REL:
+				ioctl(_fd, UI_SET_RELBIT, code);
+				break;
+			case EV_ABS:
+				ioctl(_fd, UI_SET_ABSBIT, code);
+				dev.absmin[code] = -ABS_LIMIT;
+				dev.absmax[code] = ABS_LIMIT;
+				break;
+			}
+		}
+	}
+	if(write(_fd, &dev, sizeof(dev)) != sizeof(dev) || ioctl(_fd, UI_DEV_CREATE) < 0) {
+		std::cerr << "ERROR: Could not create uinput device " << name << std::endl;
+		close(_fd);
+		_fd = -1;
+	}
+}
+
+OutputDevice::OutputDevice(int fd) : _fd(fd) {
+}
+
+OutputDevice::OutputDevice(OutputDevice&& other) : id(other.id), keep(other.keep), _fd(other._fd) {
+	other._fd = -1;
+}
+
+OutputDevice::~OutputDevice() {
+	if(_fd < 0)
+		return;
+	if(!keep)
+		ioctl(_fd, UI_DEV_DESTROY);
+	close(_fd);
+}
+
+void OutputDevice::send(unsigned int type, unsigned int code, int value) {
+	global.recorder.record(FlightRecorder::OUTPUT, id, type, code, value, recorderOrigin, recorderDetail);
+	if(global.macroRecorder.active.load(std::memory_order_relaxed) && recorderOrigin != FlightRecorder::ORIGIN_MACRO) {
+		MacroRecorder& r = global.macroRecorder;
+		std::lock_guard<std::mutex> lk(r.mutex);
+		auto now = std::chrono::steady_clock::now();
+		if(r.macro.events.empty())
+			r.last = now;
+		bool stray = false;
+		if(type == EV_KEY && code < KEY_CNT) {
+			stray = value != 1 && !r.held[id][code];
+			r.held[id][code] = value != 0;
 		}
+		if(!stray && r.macro.events.size() < MacroRecorder::MAX_EVENTS) {
+			uint32_t delay = std::chrono::duration_cast<std::chrono::microseconds>(now - r.last).count();
+			r.macro.events.push_back({ delay, uint16_t(type), uint16_t(code), value, id, {} });
+			r.last = now;
 		}
-		break;
-	case Settings::UNKNOWN_NUB_AXIS_MODE:
-		break;
 	}
+	if(_fd < 0)
+		return;
+	input_event e;
+	memset(&e, 0, sizeof(e));
+	e.type = type;
+	e.code = code;
+	e.value = value;
+	if(write(_fd, &e, sizeof(e)) != sizeof(e))
+		std::cerr << "WARNING: Could not write uinput event" << std::endl;
+}
+
+#ifdef HAVE_LIBSYSTEMD
+std::unordered_map<std::string, int> takeStoredFds() {
+	std::unordered_map<std::string, int> fds;
+	char** names = nullptr;
+	int n = sd_listen_fds_with_names(1, &names);
+	for(int i = 0; i < n; ++i) {
+		fds[names[i]] = SD_LISTEN_FDS_START + i;
+		free(names[i]);
+	}
+	free(names);
+	// The state is only valid once, the devices stay stored
+	if(fds.count("state"))
+		sd_pid_notify(0, 0, "FDSTOREREMOVE=1\nFDNAME=state");
+	global.handover = getenv("NOTIFY_SOCKET") != nullptr;
+	return fds;
+}
+
+void storeFd(std::string const& name, int fd) {
+	if(fd < 0 || !global.handover)
+		return;
+	std::string state = "FDSTORE=1\nFDNAME=" + name;
+	if(sd_pid_notify_with_fds(0, 0, state.c_str(), &fd, 1) <= 0) {
+		std::cerr << "WARNING: Could not store " << name << " in the systemd fd store" << std::endl;
+		global.handover = false;
+	}
+}
+#else
+std::unordered_map<std::string, int> takeStoredFds() {
+	return {};
+}
+
+void storeFd(std::string const& name, int fd) {
+}
+#endif
+
+void storeState() {
+	HandoverState state = HandoverState();
+	state.version = HandoverState::VERSION;
+	state.size = sizeof(state);
+	Profile* profile = global.profile.load();
+	strncpy(state.profile, profile->name.c_str(), sizeof(state.profile) - 1);
+	state.Fn = global.Fn;
+	state.Alt = global.Alt;
+	state.Shift = global.Shift;
+	state.Ctrl = global.Ctrl;
+	state.hatx = global.hatx;
+	state.haty = global.haty;
+	for(unsigned int code = FIRST_KEY; code <= LAST_KEY; ++code) {
+		auto* with = global.pressedWith[code - FIRST_KEY];
+		if(with)
+			state.keys[code - FIRST_KEY] = 1 | (with->pressedAs(code) << 1);
+	}
+	for(unsigned int i = 0; i < profile->routes.size(); ++i) {
+		for(unsigned int j = 0; j < profile->routes[i].count; ++j) {
+			state.buttons[i][j] = profile->routes[i].sinks[j].state;
+		}
+	}
+
+	int fd = memfd_create("pyrainput-state", MFD_CLOEXEC);
+	if(fd < 0 || write(fd, &state, sizeof(state)) != sizeof(state)) {
+		std::cerr << "WARNING: Could not save state for the next instance" << std::endl;
+	} else {
+		storeFd("state", fd);
+	}
+	if(fd >= 0)
+		close(fd);
+}
+
+void restoreState(int fd) {
+	HandoverState state;
+	bool ok = pread(fd, &state, sizeof(state), 0) == sizeof(state)
+	       && state.version == HandoverState::VERSION && state.size == sizeof(state);
+	close(fd);
+	if(!ok) {
+		std::cerr << "WARNING: Ignoring state from an incompatible instance" << std::endl;
+		releaseAll(global.keyboard);
+		releaseAll(global.gamepad);
+		releaseAll(&global.mouse->device);
+		return;
+	}
+	state.profile[sizeof(state.profile) - 1] = 0;
+	auto iter = global.profiles.find(state.profile);
+	if(iter != global.profiles.end())
+		global.profile = iter->second;
+	Profile* profile = global.profile.load();
+
+	global.Fn = state.Fn;
+	global.Alt = state.Alt;
+	global.Shift = state.Shift;
+	global.Ctrl = state.Ctrl;
+	global.hatx = state.hatx;
+	global.haty = state.haty;
+	for(unsigned int code = FIRST_KEY; code <= LAST_KEY; ++code) {
+		uint8_t key = state.keys[code - FIRST_KEY];
+		if(!(key & 1))
+			continue;
+		global.pressedWith[code - FIRST_KEY] = &profile->behaviors;
+		profile->behaviors.setPressedAs(code, key & 2);
+		global.debounce.raw[code - FIRST_KEY] = global.debounce.state[code - FIRST_KEY] = 1;
+	}
+	// Keys let go of during the handover never send their release to us
+	std::array<uint8_t, LAST_KEY - FIRST_KEY + 1> held{};
+	if(!readKeypadState(held))
+		std::cerr << "WARNING: Could not read the keypad state, releasing held keys" << std::endl;
+	{
+		std::lock_guard<std::mutex> lk(global.dispatch);
+		for(unsigned int code = FIRST_KEY; code <= LAST_KEY; ++code) {
+			if(!(state.keys[code - FIRST_KEY] & 1) || held[code - FIRST_KEY])
+				continue;
+			setOrigin(FlightRecorder::ORIGIN_KEY, code);
+			global.debounce.raw[code - FIRST_KEY] = global.debounce.state[code - FIRST_KEY] = 0;
+			dispatchKey(code, 0);
+		}
+	}
+	setOrigin(FlightRecorder::ORIGIN_PROFILE);
+	std::array<bool, 2> orphaned{};
+	for(unsigned int i = 0; i < profile->routes.size(); ++i) {
+		for(unsigned int j = 0; j < AxisRoute::MAX_SINKS; ++j) {
+			int held = state.buttons[i][j];
+			if(held == 0)
+				continue;
+			AxisSink* sink = j < profile->routes[i].count ? &profile->routes[i].sinks[j] : nullptr;
+			if(sink && sink->type == AxisSink::MOUSE_BTN) {
+				// The button is still down on the adopted device
+				sink->state = held;
+				++global.mouse->axisHolders[held == 1];
+			} else {
+				// Routes changed under the held button
+				orphaned[held == 1] = true;
+			}
+		}
+	}
+	for(unsigned int i = 0; i < orphaned.size(); ++i) {
+		if(orphaned[i] && global.mouse->axisHolders[i] == 0) {
+			global.mouse->device.send(EV_KEY, i ? BTN_RIGHT : BTN_LEFT, 0);
+			global.mouse->device.send(EV_SYN, 0, 0);
+		}
+	}
+}
+
+// Release the nub buttons still down through their usual path, as if the
+// nubs had reported them released
+void releaseNubButtons() {
+	for(unsigned int role = 0; role < ROUTED_ROLES; ++role) {
+		for(unsigned int thumb = 0; thumb < 2; ++thumb) {
+			if(!global.nubPressedWith[role][thumb])
+				continue;
+			input_event e;
+			memset(&e, 0, sizeof(e));
+			e.type = EV_KEY;
+			e.code = thumb ? BTN_THUMBL : BTN_LEFT;
+			e.value = 0;
+			handle(e, role);
+		}
+	}
+}
+
+// Keypad input devices, as matched by the service
+static char const* const KEYPAD_DEVICES[] = { "tca8418", "pyra-gpio-keys@1" };
+
+// Reads the keys currently down on the keypad input devices, returns
+// whether any keypad device was found
+bool readKeypadState(std::array<uint8_t, LAST_KEY - FIRST_KEY + 1>& held) {
+	DIR* dir = opendir("/dev/input");
+	if(!dir)
+		return false;
+	bool found = false;
+	while(dirent* entry = readdir(dir)) {
+		if(strncmp(entry->d_name, "event", 5) != 0)
+			continue;
+		int fd = open((std::string("/dev/input/") + entry->d_name).c_str(), O_RDONLY | O_CLOEXEC);
+		if(fd < 0)
+			continue;
+		char name[256] = {};
+		bool keypad = false;
+		if(ioctl(fd, EVIOCGNAME(sizeof(name) - 1), name) >= 0) {
+			for(char const* match : KEYPAD_DEVICES) {
+				keypad = keypad || strstr(name, match);
+			}
+		}
+		uint8_t bits[KEY_MAX / 8 + 1] = {};
+		if(keypad && ioctl(fd, EVIOCGKEY(sizeof(bits)), bits) >= 0) {
+			found = true;
+			for(unsigned int code = FIRST_KEY; code <= LAST_KEY; ++code) {
+				if(bits[code / 8] & (1 << (code % 8)))
+					held[code - FIRST_KEY] = 1;
+			}
+		}
+		close(fd);
+	}
+	closedir(dir);
+	return found;
+}
+
+// Releasing keys that are not held is filtered by the input core
+void releaseAll(OutputDevice* device) {
+	setOrigin(FlightRecorder::ORIGIN_PROFILE);
+	for(unsigned int code = 0; code < KEY_CNT; ++code) {
+		device->send(EV_KEY, code, 0);
+	}
+	if(device->id == FlightRecorder::DEVICE_GAMEPAD) {
+		// Centers the hat and the sticks
+		for(unsigned int code : { ABS_HAT0X, ABS_HAT0Y, ABS_X, ABS_Y, ABS_RX, ABS_RY }) {
+			device->send(EV_ABS, code, 0);
+		}
+	}
+	device->send(EV_SYN, 0, 0);
+}
+
+void configureRecorder(Settings const& settings) {
+	global.recorder.enabled = settings.recorderEnable;
+	strncpy(global.recorder.path, settings.recorderFile.c_str(), sizeof(global.recorder.path) - 1);
+}
+
+// Dumps on SIGQUIT and keeps running, dumps then dies on crash signals
+void dumpRecorder(int sig) {
+	global.recorder.dump();
+	if(sig != SIGQUIT) {
+		signal(sig, SIG_DFL);
+		raise(sig);
+	}
+}
+
+void buildAxisRoutes(AxisRoutes& routes, Settings const& settings) {
+	struct {
+		Role role;
+		unsigned int code;
+		unsigned int gamepad;
+		std::vector<Settings::NubAxisMode> const& modes;
+	} const axes[] = {
+		{ ROLE_LEFT_NUB,	ABS_X, ABS_X,	settings.leftNubModeX },
+		{ ROLE_LEFT_NUB,	ABS_Y, ABS_Y,	settings.leftNubModeY },
+		{ ROLE_RIGHT_NUB,	ABS_X, ABS_RX,	settings.rightNubModeX },
+		{ ROLE_RIGHT_NUB,	ABS_Y, ABS_RY,	settings.rightNubModeY }
+	};
+	for(auto const& axis : axes) {
+		AxisRoute& route = routes.at(axis.role * ROUTED_CODES + axis.code);
+		route = AxisRoute();
+		if (settings.exportGamepad)
+			route.sinks[route.count++] = { AxisSink::GAMEPAD, uint16_t(axis.gamepad), 0 };
+		if (!settings.exportMouse)
+			continue;
+		for(auto mode : axis.modes) {
+			AxisSink::Type type;
+			switch(mode) {
+			case Settings::MOUSE_X:		type = AxisSink::MOUSE_X; break;
+			case Settings::MOUSE_Y:		type = AxisSink::MOUSE_Y; break;
+			case Settings::SCROLL_X:	type = AxisSink::SCROLL_X; break;
+			case Settings::SCROLL_Y:	type = AxisSink::SCROLL_Y; break;
+			case Settings::MOUSE_BTN:	type = AxisSink::MOUSE_BTN; break;
+			default: continue;
+			}
+			if (route.count == AxisRoute::MAX_SINKS) {
+				std::cerr << "WARNING: Too many outputs for a nub axis, ignoring the extra ones" << std::endl;
+				break;
+			}
+			route.sinks[route.count++] = { type, 0, 0 };
+		}
+	}
+}
+
+void routeNubAxis(AxisRoute& route, int value, Mouse* mouse, OutputDevice* gamepad, Settings const& settings) {
+	for(unsigned int i = 0; i < route.count; ++i) {
+		AxisSink& sink = route.sinks[i];
+		setOrigin(sink.type == AxisSink::GAMEPAD ? FlightRecorder::ORIGIN_NUB_GAMEPAD : FlightRecorder::ORIGIN_NUB_AXIS, sink.type);
+		switch(sink.type) {
+		case AxisSink::GAMEPAD:
+			if (value > settings.joyDeadzone || value < -settings.joyDeadzone) {
+				gamepad->send(EV_ABS, sink.code, value);
+				gamepad->send(EV_SYN, 0, 0);
+			}
+			break;
+		case AxisSink::MOUSE_X:
+			mouse->dx = value;
+			if(mouse->dx > settings.mouseDeadzone || mouse->dx < -settings.mouseDeadzone)
+				mouse->signal.notify_all();
+			break;
+		case AxisSink::MOUSE_Y:
+			mouse->dy = value;
+			if(mouse->dy > settings.mouseDeadzone || mouse->dy < -settings.mouseDeadzone)
+				mouse->signal.notify_all();
+			break;
+		case AxisSink::SCROLL_X:
+			mouse->dwx = value;
+			if(mouse->dwx > settings.mouseDeadzone || mouse->dwx < -settings.mouseDeadzone)
+				mouse->signal.notify_all();
+			break;
+		case AxisSink::SCROLL_Y:
+			mouse->dwy = value;
+			if(mouse->dwy > settings.mouseDeadzone  || mouse->dwy < -settings.mouseDeadzone)
+				mouse->signal.notify_all();
+			break;
+		case AxisSink::MOUSE_BTN: {
+			int new_val = 0;
+			if (value < -settings.mouseClickDeadzone) 
+				new_val = -1;
+			else if (value > settings.mouseClickDeadzone) 
+				new_val = 1;
+			if (sink.state != new_val) {
+				std::lock_guard<std::mutex> lk(mouse->mutex);
+				holdAxisButton(mouse, sink.state, false);
+				holdAxisButton(mouse, new_val, true);
+				mouse->device.send(EV_SYN, 0, 0);
+				sink.state = new_val;
+			}
+			}
+			break;
+		}
+	}
+}
+
+void releaseAxisButtons(AxisRoutes& routes, Mouse* mouse) {
+	setOrigin(FlightRecorder::ORIGIN_PROFILE);
+	for(auto& route : routes) {
+		for(unsigned int i = 0; i < route.count; ++i) {
+			AxisSink& sink = route.sinks[i];
+			if (sink.type != AxisSink::MOUSE_BTN || sink.state == 0)
+				continue;
+			std::lock_guard<std::mutex> lk(mouse->mutex);
+			holdAxisButton(mouse, sink.state, false);
+			mouse->device.send(EV_SYN, 0, 0);
+			sink.state = 0;
+		}
+	}
+}
+
+// Axis sinks share the mouse buttons: the first holder presses one and the
+// last one releases it. The caller holds mouse->mutex.
+void holdAxisButton(Mouse* mouse, int state, bool held) {
+	if (state == 0)
+		return;
+	unsigned int& holders = mouse->axisHolders[state == 1];
+	if (held) {
+		if (holders++ == 0)
+			mouse->device.send(EV_KEY, state == -1 ? BTN_LEFT : BTN_RIGHT, 1);
+	} else if (holders > 0 && --holders == 0) {
+		mouse->device.send(EV_KEY, state == -1 ? BTN_LEFT : BTN_RIGHT, 0);
+	}
+}
+
+// Nub buttons release with the profile they were pressed with, like keys.
+// The caller holds global.dispatch, which collectRetired() runs under.
+Profile* nubButtonProfile(unsigned int role, unsigned int code, int value) {
+	Profile* profile = global.profile.load();
+	if (role >= ROUTED_ROLES)
+		return profile;
+	Profile*& with = global.nubPressedWith[role][code == BTN_THUMBL || code == BTN_THUMBR];
+	if (value == 1)
+		with = profile;
+	else if (with)
+		profile = with;
+	if (value == 0)
+		with = nullptr;
+	return profile;
 }
 
-void handleNubClick(Settings::NubClickMode mode, int value, Mouse* mouse, UinputDevice* gamepad, Settings const& settings) {
+void handleNubClick(Settings::NubClickMode mode, int value, Mouse* mouse, OutputDevice* gamepad, Settings const& settings) {
+	setOrigin(FlightRecorder::ORIGIN_NUB_CLICK, mode);
 	switch(mode) {
 	case Settings::MOUSE_LEFT: {
-		if (global.settings.exportMouse) {
+		if (settings.exportMouse) {
 			std::lock_guard<std::mutex> lk(mouse->mutex);
 			mouse->device.send(EV_KEY, BTN_LEFT, value);
 			mouse->device.send(EV_SYN, 0, 0);
@@ -616,7 +1676,7 @@ void handleNubClick(Settings::NubClickMode mode, int value, Mouse* mouse, Uinput
 		break;
 	}
 	case Settings::MOUSE_RIGHT: {
-		if (global.settings.exportMouse) {
+		if (settings.exportMouse) {
 			std::lock_guard<std::mutex> lk(mouse->mutex);
 			mouse->device.send(EV_KEY, BTN_RIGHT, value);
 			mouse->device.send(EV_SYN, 0, 0);
@@ -624,13 +1684,13 @@ void handleNubClick(Settings::NubClickMode mode, int value, Mouse* mouse, Uinput
 		break;
 	}
 	case Settings::NUB_CLICK_LEFT:
-		if (global.settings.exportGamepad) {
+		if (settings.exportGamepad) {
 			gamepad->send(EV_KEY, BTN_THUMBL, value);
 			gamepad->send(EV_SYN, 0, 0);
 		}
 		break;
 	case Settings::NUB_CLICK_RIGHT:
-		if (global.settings.exportGamepad) {
+		if (settings.exportGamepad) {
 			gamepad->send(EV_KEY, BTN_THUMBR, value);
 			gamepad->send(EV_SYN, 0, 0);
 		}
@@ -640,9 +1700,15 @@ void handleNubClick(Settings::NubClickMode mode, int value, Mouse* mouse, Uinput
 	}
 }
 
-void handleMouse(Mouse* mouse, Settings* settings, bool* stop) {
+void handleMouse(Mouse* mouse, std::atomic<Profile*>* profile, bool* stop) {
+	setOrigin(FlightRecorder::ORIGIN_MOUSE_THREAD);
 	while(!*stop) {
-		if((mouse->dx > settings->mouseDeadzone || mouse->dx < -settings->mouseDeadzone || mouse->dy > settings->mouseDeadzone || mouse->dy < -settings->mouseDeadzone || mouse->dwx > settings->mouseClickDeadzone || mouse->dwx < -settings->mouseClickDeadzone || mouse->dwy > settings->mouseWheelDeadzone || mouse->dwy < -settings->mouseWheelDeadzone)&&global.settings.exportMouse) {
+		Settings const* settings = &profile->load()->settings;
+		if(settings->nubCalibration) {
+			settleNubs();
+			setOrigin(FlightRecorder::ORIGIN_MOUSE_THREAD);
+		}
+		if((mouse->dx > settings->mouseDeadzone || mouse->dx < -settings->mouseDeadzone || mouse->dy > settings->mouseDeadzone || mouse->dy < -settings->mouseDeadzone || mouse->dwx > settings->mouseClickDeadzone || mouse->dwx < -settings->mouseClickDeadzone || mouse->dwy > settings->mouseWheelDeadzone || mouse->dwy < -settings->mouseWheelDeadzone)&&settings->exportMouse) {
 			std::lock_guard<std::mutex> lk(mouse->mutex);
 
 			if(mouse->dx > settings->mouseDeadzone) {
@@ -676,7 +1742,355 @@ void handleMouse(Mouse* mouse, Settings* settings, bool* stop) {
 		}
 		std::this_thread::sleep_for(std::chrono::milliseconds(16));
 	}
-	delete mouse;
+}
+
+// Dispatch a keypad key, the caller holds global.dispatch
+void dispatchKey(unsigned int code, int value) {
+	// Kernel repeats are replaced by the timer thread ones
+	if (value == 2 && global.settings().keyRepeat)
+		return;
+	// Keys release with the profile they were pressed with
+	auto* behaviors = &global.profile.load()->behaviors;
+	if (code >= FIRST_KEY && code <= LAST_KEY) {
+		auto& with = global.pressedWith[code - FIRST_KEY];
+		if (value == 1)
+			with = behaviors;
+		else if (with)
+			behaviors = with;
+		if (value == 0)
+			with = nullptr;
+	}
+	// Repeat stops before the release so no repeat can follow it
+	if (value == 0)
+		stopRepeat(code);
+	behaviors->handle(code, value);
+	global.keyboard->send(EV_SYN, 0, 0);
+	if (value == 1 && global.settings().keyRepeat)
+		startRepeat(code, *behaviors, global.settings());
+	if (value == 0 && !global.retired.empty())
+		collectRetired();
+}
+
+uint32_t steadyMs() {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Returns whether the event goes on to dispatch, the caller holds global.dispatch
+bool debounceKey(unsigned int code, int value, Settings const& settings) {
+	if (code < FIRST_KEY || code > LAST_KEY)
+		return true;
+	Debounce& d = global.debounce;
+	unsigned int i = code - FIRST_KEY;
+	if (value == 2)
+		return d.state[i] != 0;
+	uint8_t raw = (value != 0);
+	if (raw == d.raw[i]) {
+		// Same state again from the keypad: a duplicate or a ghost
+		++d.filtered[i];
+		return false;
+	}
+	d.raw[i] = raw;
+	if (raw == d.state[i]) {
+		// A bounce back within the window, drops the deferred change too
+		d.filtered[i] += 2;
+		return false;
+	}
+	uint32_t now = steadyMs();
+	if (settings.debounceWindow <= 0 || now - d.last[i] >= uint32_t(settings.debounceWindow)) {
+		d.state[i] = d.raw[i];
+		d.last[i] = now;
+		return true;
+	}
+	// Deferred, settleDebounce() forwards it unless it bounces back
+	auto at = std::chrono::steady_clock::now() + std::chrono::milliseconds(settings.debounceWindow - (now - d.last[i]));
+	std::lock_guard<std::mutex> lk(global.timer.mutex);
+	if (!global.timer.debouncePending || at < global.timer.debounceAt) {
+		global.timer.debouncePending = true;
+		global.timer.debounceAt = at;
+		global.timer.signal.notify_all();
+	}
+	return false;
+}
+
+// Forward keys whose window ended in another state than the one forwarded
+void settleDebounce() {
+	std::lock_guard<std::mutex> lk(global.dispatch);
+	Debounce& d = global.debounce;
+	Settings const& settings = global.settings();
+	uint32_t now = steadyMs();
+	uint32_t next = 0;
+	for (unsigned int i = 0; i < Debounce::NUM_KEYS; ++i) {
+		if (d.raw[i] == d.state[i])
+			continue;
+		uint32_t elapsed = now - d.last[i];
+		if (elapsed >= uint32_t(settings.debounceWindow)) {
+			d.state[i] = d.raw[i];
+			d.last[i] = now;
+			dispatchKey(FIRST_KEY + i, d.raw[i]);
+		} else if (next == 0 || settings.debounceWindow - elapsed < next) {
+			next = settings.debounceWindow - elapsed;
+		}
+	}
+	if (next) {
+		std::lock_guard<std::mutex> tlk(global.timer.mutex);
+		global.timer.debouncePending = true;
+		global.timer.debounceAt = std::chrono::steady_clock::now() + std::chrono::milliseconds(next);
+	}
+}
+
+void loadDebounceStats(std::string const& filename) {
+	std::ifstream file(filename);
+	unsigned int code, count;
+	while(file >> code >> count) {
+		if (code >= FIRST_KEY && code <= LAST_KEY)
+			global.debounce.filtered[code - FIRST_KEY] = count;
+	}
+}
+
+void saveDebounceStats(std::string const& filename) {
+	std::ofstream file(filename);
+	if(!file) {
+		std::cerr << "ERROR: Could not write debounce statistics " << filename << std::endl;
+		return;
+	}
+	for (unsigned int i = 0; i < Debounce::NUM_KEYS; ++i) {
+		if (global.debounce.filtered[i])
+			file << FIRST_KEY + i << " " << global.debounce.filtered[i] << std::endl;
+	}
+}
+
+static char const MACRO_MAGIC[8] = { 'P', 'Y', 'R', 'A', 'M', 'A', 'C', '1' };
+
+// Returns the file of a macro name, or an empty string if the name could
+// leave MACRO_DIR
+std::string macroPath(std::string const& name) {
+	if(name.empty() || name.find('/') != std::string::npos || name.find("..") != std::string::npos) {
+		std::cerr << "ERROR: Invalid macro name " << name << std::endl;
+		return std::string();
+	}
+	return MACRO_DIR + name;
+}
+
+// Macro files are the magic, a 32 bits event count and the raw events
+bool loadMacro(std::string const& filename, Macro& macro) {
+	std::ifstream file(filename, std::ios::binary);
+	char magic[sizeof(MACRO_MAGIC)];
+	uint32_t count = 0;
+	if(!file.read(magic, sizeof(magic)) || memcmp(magic, MACRO_MAGIC, sizeof(magic)) != 0
+	 || !file.read(reinterpret_cast<char*>(&count), sizeof(count)) || count > MacroRecorder::MAX_EVENTS) {
+		std::cerr << "ERROR: Invalid macro file " << filename << std::endl;
+		return false;
+	}
+	macro.events.resize(count);
+	if(!file.read(reinterpret_cast<char*>(macro.events.data()), count * sizeof(MacroEvent))) {
+		std::cerr << "ERROR: Truncated macro file " << filename << std::endl;
+		macro.events.clear();
+		return false;
+	}
+	return true;
+}
+
+bool saveMacro(std::string const& filename, Macro const& macro) {
+	std::ofstream file(filename, std::ios::binary);
+	uint32_t count = macro.events.size();
+	file.write(MACRO_MAGIC, sizeof(MACRO_MAGIC));
+	file.write(reinterpret_cast<char const*>(&count), sizeof(count));
+	file.write(reinterpret_cast<char const*>(macro.events.data()), count * sizeof(MacroEvent));
+	if(!file) {
+		std::cerr << "ERROR: Could not write macro file " << filename << std::endl;
+		return false;
+	}
+	return true;
+}
+
+void startMacro(Macro const* macro) {
+	if(macro->events.empty())
+		return;
+	std::lock_guard<std::mutex> lk(global.timer.mutex);
+	for(auto& p : global.timer.playbacks) {
+		if(p.macro)
+			continue;
+		p.macro = macro;
+		p.next = 0;
+		p.held = HeldKeys();
+		p.at = std::chrono::steady_clock::now() + std::chrono::microseconds(macro->events[0].delay);
+		global.timer.signal.notify_all();
+		return;
+	}
+	std::cerr << "WARNING: Too many macros playing, ignoring" << std::endl;
+}
+
+// Send every due macro event, the caller holds global.dispatch and timer->mutex
+void sendMacroEvent(unsigned int device, unsigned int type, unsigned int code, int value) {
+	switch(device) {
+	case FlightRecorder::DEVICE_KEYBOARD:
+		global.keyboard->send(type, code, value);
+		break;
+	case FlightRecorder::DEVICE_GAMEPAD:
+		global.gamepad->send(type, code, value);
+		break;
+	case FlightRecorder::DEVICE_MOUSE: {
+		std::lock_guard<std::mutex> mlk(global.mouse->mutex);
+		global.mouse->device.send(type, code, value);
+		break;
+	}
+	}
+}
+
+void playMacros(Timer* timer, std::chrono::steady_clock::time_point now) {
+	setOrigin(FlightRecorder::ORIGIN_MACRO);
+	for(auto& p : timer->playbacks) {
+		while(p.macro && p.at <= now) {
+			MacroEvent const& e = p.macro->events[p.next];
+			sendMacroEvent(e.device, e.type, e.code, e.value);
+			if(e.type == EV_KEY && e.code < KEY_CNT && e.device < p.held.size())
+				p.held[e.device][e.code] = e.value != 0;
+			if(++p.next < p.macro->events.size())
+				p.at += std::chrono::microseconds(p.macro->events[p.next].delay);
+			else
+				releasePlayback(p);
+		}
+	}
+	setOrigin(FlightRecorder::ORIGIN_TIMER);
+}
+
+// End a playback, releasing the keys its macro left down
+void releasePlayback(Timer::Playback& p) {
+	setOrigin(FlightRecorder::ORIGIN_MACRO);
+	p.macro = nullptr;
+	for(unsigned int device = 0; device < p.held.size(); ++device) {
+		if(p.held[device].none())
+			continue;
+		for(unsigned int code = 0; code < KEY_CNT; ++code) {
+			if(p.held[device][code])
+				sendMacroEvent(device, EV_KEY, code, 0);
+		}
+		sendMacroEvent(device, EV_SYN, 0, 0);
+	}
+	p.held = HeldKeys();
+}
+
+void startMacroRecording(std::string const& name) {
+	std::string filename = macroPath(name);
+	if(filename.empty())
+		return;
+	if(mkdir(MACRO_DIR, 0755) != 0 && errno != EEXIST) {
+		std::cerr << "ERROR: Could not create " << MACRO_DIR << ": " << strerror(errno) << std::endl;
+		return;
+	}
+	std::lock_guard<std::mutex> lk(global.macroRecorder.mutex);
+	global.macroRecorder.file = filename;
+	global.macroRecorder.macro.events.clear();
+	global.macroRecorder.held = HeldKeys();
+	global.macroRecorder.active = true;
+	std::cout << "Recording macro to " << filename << std::endl;
+}
+
+void stopMacroRecording() {
+	std::lock_guard<std::mutex> lk(global.macroRecorder.mutex);
+	if(!global.macroRecorder.active)
+		return;
+	global.macroRecorder.active = false;
+	// Drop the presses of keys still down since their last release, their
+	// delays go to the next event kept
+	MacroRecorder& r = global.macroRecorder;
+	HeldKeys trailing = r.held;
+	std::vector<bool> drop(r.macro.events.size());
+	for(size_t i = r.macro.events.size(); i-- > 0;) {
+		MacroEvent const& e = r.macro.events[i];
+		if(e.type != EV_KEY || e.code >= KEY_CNT || !trailing[e.device][e.code])
+			continue;
+		if(e.value == 0)
+			trailing[e.device][e.code] = false;
+		else
+			drop[i] = true;
+	}
+	Macro macro;
+	uint32_t delay = 0;
+	for(size_t i = 0; i < r.macro.events.size(); ++i) {
+		delay += r.macro.events[i].delay;
+		if(drop[i])
+			continue;
+		macro.events.push_back(r.macro.events[i]);
+		macro.events.back().delay = delay;
+		delay = 0;
+	}
+	if(saveMacro(r.file, macro))
+		std::cout << "Saved macro " << r.file << std::endl;
+	r.macro.events.clear();
+}
+
+// Fn+Ctrl with a macro key starts recording that macro and stops it again
+void toggleMacroRecording(std::string const& name) {
+	if(global.macroRecorder.active)
+		stopMacroRecording();
+	else
+		startMacroRecording(name);
+}
+
+void handleTimer(Timer* timer, bool* stop) {
+	setOrigin(FlightRecorder::ORIGIN_TIMER);
+	std::unique_lock<std::mutex> lk(timer->mutex);
+	while(!*stop) {
+		auto at = std::chrono::steady_clock::time_point::max();
+		if(timer->repeatCode >= 0)
+			at = std::min(at, timer->repeatAt);
+		if(timer->debouncePending)
+			at = std::min(at, timer->debounceAt);
+		for(auto const& p : timer->playbacks) {
+			if(p.macro)
+				at = std::min(at, p.at);
+		}
+		if(at == std::chrono::steady_clock::time_point::max()) {
+			timer->signal.wait(lk);
+			continue;
+		}
+		if(timer->signal.wait_until(lk, at) != std::cv_status::timeout)
+			continue;
+		// Output is sent under global.dispatch, which is locked first
+		lk.unlock();
+		std::unique_lock<std::mutex> dlk(global.dispatch);
+		lk.lock();
+		auto now = std::chrono::steady_clock::now();
+		if(timer->repeatCode >= 0 && now >= timer->repeatAt) {
+			setOrigin(FlightRecorder::ORIGIN_TIMER);
+			global.keyboard->send(EV_KEY, timer->repeatCode, 2);
+			global.keyboard->send(EV_SYN, 0, 0);
+			timer->repeatAt += timer->repeatInterval;
+		}
+		playMacros(timer, now);
+		bool settle = timer->debouncePending && now >= timer->debounceAt;
+		if(settle)
+			timer->debouncePending = false;
+		lk.unlock();
+		dlk.unlock();
+		if(settle)
+			settleDebounce();
+		lk.lock();
+	}
+}
+
+// Like the kernel, only the last pressed key repeats
+void startRepeat(unsigned int code, KeyBehaviors<FIRST_KEY, LAST_KEY> const& behaviors, Settings const& settings) {
+	bool navigation = false;
+	int output = behaviors.repeatCode(code, &navigation);
+	auto cls = navigation ? Settings::REPEAT_NAVIGATION : Settings::REPEAT_KEYS;
+	std::lock_guard<std::mutex> lk(global.timer.mutex);
+	if(output < 0 || settings.repeatRate[cls] <= 0) {
+		global.timer.repeatKey = global.timer.repeatCode = -1;
+		return;
+	}
+	global.timer.repeatKey = code;
+	global.timer.repeatCode = output;
+	global.timer.repeatInterval = std::chrono::microseconds(1000000 / settings.repeatRate[cls]);
+	global.timer.repeatAt = std::chrono::steady_clock::now() + std::chrono::milliseconds(settings.repeatDelay[cls]);
+	global.timer.signal.notify_all();
+}
+
+void stopRepeat(unsigned int code) {
+	std::lock_guard<std::mutex> lk(global.timer.mutex);
+	if(global.timer.repeatKey == int(code))
+		global.timer.repeatKey = global.timer.repeatCode = -1;
 }
 
 template<int FIRST_KEY, int LAST_KEY> void KeyBehaviors<FIRST_KEY, LAST_KEY>::passthrough(unsigned int code) {
@@ -727,9 +2141,52 @@ template<int FIRST_KEY, int LAST_KEY> void KeyBehaviors<FIRST_KEY, LAST_KEY>::sc
 	b.scripts = s;
 }
 
+template<int FIRST_KEY, int LAST_KEY> bool KeyBehaviors<FIRST_KEY, LAST_KEY>::pressedAs(unsigned int code) const {
+	return behaviors.at(code - FIRST_KEY).pressed_as;
+}
+
+template<int FIRST_KEY, int LAST_KEY> void KeyBehaviors<FIRST_KEY, LAST_KEY>::setPressedAs(unsigned int code, bool alternative) {
+	behaviors.at(code - FIRST_KEY).pressed_as = alternative;
+}
+
+template<int FIRST_KEY, int LAST_KEY> int KeyBehaviors<FIRST_KEY, LAST_KEY>::repeatCode(unsigned int code, bool* navigation) const {
+	if (code <FIRST_KEY || code >LAST_KEY) return -1;
+	auto const& kb = behaviors.at(code - FIRST_KEY);
+	switch(code) {
+	case KEY_UP: case KEY_DOWN: case KEY_LEFT: case KEY_RIGHT:
+	case KEY_HOME: case KEY_END: case KEY_PAGEUP: case KEY_PAGEDOWN:
+		*navigation = true;
+		break;
+	default:
+		*navigation = false;
+	}
+	switch(kb.type) {
+	case KeyBehavior::PASSTHROUGH:
+		return code;
+	case KeyBehavior::MAPPED:
+		return kb.mapping;
+	case KeyBehavior::ALTMAPPED:
+		return kb.pressed_as ? kb.alternative : kb.mapping;
+	case KeyBehavior::GPMAPPED:
+		return settings->exportKeypad ? int(code) : -1;
+	case KeyBehavior::GPHAT:
+		return code;
+	default:
+		// Modifiers, scripts and complex keys
+		return -1;
+	}
+}
+
+template<int FIRST_KEY, int LAST_KEY> void KeyBehaviors<FIRST_KEY, LAST_KEY>::macro(unsigned int code, Macro const* m) {
+	auto& b = behaviors.at(code - FIRST_KEY);
+	b.type = KeyBehavior::MACRO;
+	b.macro = m;
+}
+
 template<int FIRST_KEY, int LAST_KEY> void KeyBehaviors<FIRST_KEY, LAST_KEY>::handle(unsigned int code, int value) {
 	if (code <FIRST_KEY || code >LAST_KEY) return;
 	auto& kb = behaviors.at(code - FIRST_KEY);
+	setOrigin(FlightRecorder::ORIGIN_KEY, kb.type);
 	switch(kb.type) {
 	case KeyBehavior::PASSTHROUGH:
 		global.keyboard->send(EV_KEY, code, value);
@@ -746,9 +2203,9 @@ template<int FIRST_KEY, int LAST_KEY> void KeyBehaviors<FIRST_KEY, LAST_KEY>::ha
 		kb.function(value);
 		break;
 	case KeyBehavior::GPMAPPED:
-		if (global.settings.exportKeypad)
+		if (settings->exportKeypad)
 			global.keyboard->send(EV_KEY, code, value);
-		if (global.settings.exportGamepad) {
+		if (settings->exportGamepad) {
 			global.gamepad->send(EV_KEY, kb.alternative, value);
 			global.gamepad->send(EV_SYN, 0, 0);
 		}
@@ -756,9 +2213,9 @@ template<int FIRST_KEY, int LAST_KEY> void KeyBehaviors<FIRST_KEY, LAST_KEY>::ha
 	case KeyBehavior::GPMAP2:
 		*kb.flag = (value==1);
 		kb.lr->pressed = kb.lr->left || kb.lr->right;
-		if (global.settings.exportKeypad)
+		if (settings->exportKeypad)
 			global.keyboard->send(EV_KEY, code, value);
-		if (global.settings.exportGamepad) {
+		if (settings->exportGamepad) {
 			global.gamepad->send(EV_KEY, kb.alternative, value);
 			global.gamepad->send(EV_SYN, 0, 0);
 		}
@@ -779,12 +2236,18 @@ template<int FIRST_KEY, int LAST_KEY> void KeyBehaviors<FIRST_KEY, LAST_KEY>::ha
 			global.hatx = value;
 			break;
 		};
-		if (global.settings.exportGamepad) {
+		if (settings->exportGamepad) {
 			global.gamepad->send(EV_ABS, ABS_HAT0X, global.hatx*65535);
 			global.gamepad->send(EV_ABS, ABS_HAT0Y, global.haty*65535);
 			global.gamepad->send(EV_SYN, 0, 0);
 		}
 		break;
+	case KeyBehavior::MACRO:
+		if (value==1 && global.Fn.pressed && global.Ctrl.pressed)
+			toggleMacroRecording(settings->macros.at(code));
+		else if (value==1)
+			startMacro(kb.macro);
+		break;
 	case KeyBehavior::SCRIPT:
 		if (value!=1) return;
 		int ret = 0;